@@ -360,6 +360,15 @@ gboolean on_window_key_pressed (GtkEventControllerKey *controller,
     }
 
 
+    // Page Up / Page Down = Raise / Lower layer
+    if (!editing_text && is_exact_mods (state, 0) &&
+        (keyval == GDK_KEY_Page_Up || keyval == GDK_KEY_Page_Down)) {
+        if (self->selected_layer) {
+            meme_window_move_selected_layer (self, keyval == GDK_KEY_Page_Up ? 1 : -1);
+            return TRUE;
+        }
+    }
+
     if (is_exact_mods (state, GDK_CONTROL_MASK | GDK_SHIFT_MASK) &&
         (keyval == GDK_KEY_c || keyval == GDK_KEY_C)) {
         on_copy_clipboard_clicked (self);
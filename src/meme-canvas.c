@@ -2,68 +2,77 @@
 #include "meme-core.h"
 #include <math.h>
 
+// A resized text layer is laid out again once the pointer rests this long,
+// and never more often than every TEXT_REWRAP_MIN_INTERVAL_US.
+#define TEXT_SETTLE_MS              120
+#define TEXT_REWRAP_MIN_INTERVAL_US (250 * G_TIME_SPAN_MILLISECOND)
+
+// Grab radius of the resize corners, in template pixels.
+#define CORNER_RADIUS 20.0
+
+// Cursor names are static strings, so a pointer compare says "unchanged".
+static void set_preview_cursor (MemeWindow *self, const char *name) {
+    if (self->preview_cursor == name) return;
+    self->preview_cursor = name;
+    gtk_widget_set_cursor_from_name (GTK_WIDGET (self->meme_preview), name);
+}
+
+static const char *corner_cursor (ResizeHandle h) {
+    switch (h) {
+        case HANDLE_TOP_LEFT: return "nw-resize";
+        case HANDLE_TOP_RIGHT: return "ne-resize";
+        case HANDLE_BOTTOM_LEFT: return "sw-resize";
+        case HANDLE_BOTTOM_RIGHT: return "se-resize";
+        case HANDLE_TOP: return "n-resize";
+        case HANDLE_BOTTOM: return "s-resize";
+        case HANDLE_LEFT: return "w-resize";
+        case HANDLE_RIGHT: return "e-resize";
+        case HANDLE_CENTER: return "move";
+        case HANDLE_NONE: return NULL;
+        default: return NULL;
+    }
+}
+
 void on_mouse_move (GtkEventControllerMotion *controller, double x, double y, MemeWindow *self) {
-    GList *l;
-    gboolean found;
+    ResizeHandle corner;
     double ix, iy, img_w, img_h;
-    if (!self->template_image) { gtk_widget_set_cursor (GTK_WIDGET (self->meme_preview), NULL); return; }
+    if (!self->template_image) { set_preview_cursor (self, NULL); return; }
     
     meme_get_image_coordinates(GTK_WIDGET(self->meme_preview), self->template_image, x, y, &ix, &iy);
     img_w = gdk_pixbuf_get_width(self->template_image);
     img_h = gdk_pixbuf_get_height(self->template_image);
     
     if (gtk_toggle_button_get_active(self->crop_mode_button)) {
-        const char *cursor;
         double ww = gtk_widget_get_width(GTK_WIDGET(self->meme_preview));
         double wh = gtk_widget_get_height(GTK_WIDGET(self->meme_preview));
         double scale = (ww / img_w < wh / img_h) ? (ww / img_w) : (wh / img_h);
         double rx = 24.0 / (img_w * scale);
         double ry = 24.0 / (img_h * scale);
         ResizeHandle h = meme_get_crop_handle_at_position(ix, iy, self->crop_x, self->crop_y, self->crop_w, self->crop_h, rx, ry);
-        cursor = NULL;
-        switch (h) {
-            case HANDLE_TOP_LEFT: cursor = "nw-resize"; break;
-            case HANDLE_TOP_RIGHT: cursor = "ne-resize"; break;
-            case HANDLE_BOTTOM_LEFT: cursor = "sw-resize"; break;
-            case HANDLE_BOTTOM_RIGHT: cursor = "se-resize"; break;
-            case HANDLE_TOP: cursor = "n-resize"; break;
-            case HANDLE_BOTTOM: cursor = "s-resize"; break;
-            case HANDLE_LEFT: cursor = "w-resize"; break;
-            case HANDLE_RIGHT: cursor = "e-resize"; break;
-            case HANDLE_CENTER: cursor = "move"; break;
-            case HANDLE_NONE: cursor = NULL ; break;
-            default: cursor = NULL; break;
-        }
-        gtk_widget_set_cursor_from_name(GTK_WIDGET(self->meme_preview), cursor);
+        set_preview_cursor(self, corner_cursor(h));
         return;
-  }
-
-
-  found = FALSE;
-  for (l = g_list_last(self->layers); l != NULL; l = l->prev) {
-      ImageLayer *layer = (ImageLayer *)l->data;
-      double hw = (layer->width * layer->scale) / (2.0 * img_w);
-      double hh = (layer->height * layer->scale) / (2.0 * img_h);
-      double l_left = layer->x - hw, l_right = layer->x + hw;
-      double l_top = layer->y - hh, l_bot = layer->y + hh;  
-      double cx = 20.0 / img_w;
-    
-    if (layer == self->selected_layer) {
-        if (fabs(ix - l_left) < cx && fabs(iy - l_top) < cx) { gtk_widget_set_cursor_from_name(GTK_WIDGET(self->meme_preview), "nw-resize"); found = TRUE; break; }
-        if (fabs(ix - l_right) < cx && fabs(iy - l_top) < cx) { gtk_widget_set_cursor_from_name(GTK_WIDGET(self->meme_preview), "ne-resize"); found = TRUE; break; }
-        if (fabs(ix - l_left) < cx && fabs(iy - l_bot) < cx) { gtk_widget_set_cursor_from_name(GTK_WIDGET(self->meme_preview), "sw-resize"); found = TRUE; break; }
-        if (fabs(ix - l_right) < cx && fabs(iy - l_bot) < cx) { gtk_widget_set_cursor_from_name(GTK_WIDGET(self->meme_preview), "se-resize"); found = TRUE; break; }
-    }
-    if (ix >= l_left && ix <= l_right && iy >= l_top && iy <= l_bot) {
-        gtk_widget_set_cursor_from_name (GTK_WIDGET (self->meme_preview), "move");
-        found = TRUE; break;
     }
+
+    // the selection handles sit on top of every layer
+    corner = meme_layer_store_corner_at(self->layers, meme_layer_store_index_of(self->layers, self->selected_layer),
+                                        ix * img_w, iy * img_h, CORNER_RADIUS, img_w, img_h);
+    if (corner != HANDLE_NONE)
+        set_preview_cursor(self, corner_cursor(corner));
+    else if (meme_layer_store_hit(self->layers, ix * img_w, iy * img_h, img_w, img_h) >= 0)
+        set_preview_cursor(self, "move");
+    else
+        set_preview_cursor(self, NULL);
 }
-    if (!found) gtk_widget_set_cursor (GTK_WIDGET (self->meme_preview), NULL);
+
+// The whole drag is one undo step, or none when nothing moved.
+static void begin_gesture (MemeWindow *self) {
+    meme_window_commit_edit(self);
+    meme_history_begin(self->history, self->layers);
 }
 
 void on_drag_begin (GtkGestureDrag *gesture, double x, double y, MemeWindow *self) {
-    GList *l;
+    ImageLayer *layer;
+    int hit;
     double ix, iy, img_w, img_h;
     if (!self->template_image) return;
     meme_get_image_coordinates(GTK_WIDGET(self->meme_preview), self->template_image, x, y, &ix, &iy);
@@ -88,34 +97,69 @@ void on_drag_begin (GtkGestureDrag *gesture, double x, double y, MemeWindow *sel
     }
 
 
-    for (l = g_list_last(self->layers); l != NULL; l = l->prev) {
-        ImageLayer *layer = (ImageLayer *)l->data;
-        double hw = (layer->width * layer->scale) / (2.0 * img_w);
-        double hh = (layer->height * layer->scale) / (2.0 * img_h);
-        double l_left = layer->x - hw, l_right = layer->x + hw;
-        double l_top = layer->y - hh, l_bot = layer->y + hh;
-        double cx = 20.0 / img_w;
-        gboolean corner = (fabs(ix - l_left) < cx || fabs(ix - l_right) < cx) && (fabs(iy - l_top) < cx || fabs(iy - l_bot) < cx);
-
-        if (layer == self->selected_layer && corner) {
-            push_undo(self);
-            self->drag_type = DRAG_TYPE_IMAGE_RESIZE;
-            self->selected_layer = layer;
-            self->drag_obj_start_scale = layer->scale;
-            self->drag_start_x = ix * img_w; self->drag_start_y = iy * img_h; 
-            sync_ui_with_layer(self); render_meme(self); return;
-        }
+    if (self->selected_layer &&
+        meme_layer_store_corner_at(self->layers, meme_layer_store_index_of(self->layers, self->selected_layer),
+                                   ix * img_w, iy * img_h, CORNER_RADIUS, img_w, img_h) != HANDLE_NONE) {
+        begin_gesture(self);
+        self->drag_type = DRAG_TYPE_IMAGE_RESIZE;
+        self->drag_obj_start_scale = self->selected_layer->scale;
+        self->drag_start_x = ix * img_w; self->drag_start_y = iy * img_h; 
+        sync_ui_with_layer(self); render_meme(self); return;
+    }
 
-        if (ix >= l_left && ix <= l_right && iy >= l_top && iy <= l_bot) {
-            push_undo(self);
-            self->drag_type = DRAG_TYPE_IMAGE_MOVE;
-            self->selected_layer = layer;
-            self->drag_obj_start_x = layer->x; self->drag_obj_start_y = layer->y;
-            self->drag_start_x = ix; self->drag_start_y = iy;
-            sync_ui_with_layer(self); render_meme(self); return;
-        }
+    hit = meme_layer_store_hit(self->layers, ix * img_w, iy * img_h, img_w, img_h);
+    if (hit >= 0) {
+        layer = meme_layer_store_get(self->layers, hit);
+        begin_gesture(self);
+        self->drag_type = DRAG_TYPE_IMAGE_MOVE;
+        self->selected_layer = layer;
+        self->drag_obj_start_x = layer->x; self->drag_obj_start_y = layer->y;
+        self->drag_start_x = ix; self->drag_start_y = iy;
+        meme_window_end_drag_session(self);
+        // only deep fry still composites on the CPU while dragging
+        if (gtk_toggle_button_get_active(self->deep_fry_button))
+            self->drag_session = meme_drag_session_new(self->template_image, self->template_generation,
+                                                       self->layers, layer, self->render_cache, TRUE);
+        sync_ui_with_layer(self); render_meme(self); return;
     }
-    if (self->selected_layer) { self->selected_layer = NULL; sync_ui_with_layer(self); render_meme(self); }
+    if (self->selected_layer) {
+        self->selected_layer = NULL;
+        sync_ui_with_layer(self);
+        gtk_widget_queue_draw(GTK_WIDGET(self->crop_overlay_area));
+    }
+}
+
+static void rewrap_text (MemeWindow *self, ImageLayer *layer, double wrap_scale) {
+    if (layer->type != LAYER_TYPE_TEXT || layer->text_wrap_scale == wrap_scale) return;
+    layer->text_wrap_scale = wrap_scale;
+    meme_layer_mark_dirty (layer, MEME_LAYER_DIRTY_GEOMETRY);
+    self->text_rewrapped_at = g_get_monotonic_time ();
+}
+
+static gboolean on_text_settled (gpointer user_data) {
+    MemeWindow *self = MEME_WINDOW (user_data);
+    gint64 wait = self->text_rewrapped_at + TEXT_REWRAP_MIN_INTERVAL_US - g_get_monotonic_time ();
+
+    if (wait > 0) {
+        self->text_settle_id = g_timeout_add (wait / 1000 + 1, on_text_settled, self);
+        return G_SOURCE_REMOVE;
+    }
+    self->text_settle_id = 0;
+    if (self->drag_type == DRAG_TYPE_IMAGE_RESIZE && self->selected_layer) {
+        rewrap_text (self, self->selected_layer, self->selected_layer->scale);
+        render_meme (self);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// Resizing text would re-layout and re-rasterize it on every motion event.
+// Instead the wrap width stays pinned and the last raster is scaled; the
+// text is laid out again when the pointer rests and when the drag ends.
+static void defer_text_rewrap (MemeWindow *self) {
+    if (self->selected_layer->text_wrap_scale == 0.0)
+        rewrap_text (self, self->selected_layer, self->selected_layer->scale);
+    g_clear_handle_id (&self->text_settle_id, g_source_remove);
+    self->text_settle_id = g_timeout_add (TEXT_SETTLE_MS, on_text_settled, self);
 }
 
 void on_drag_update (GtkGestureDrag *gesture, double offset_x, double offset_y, MemeWindow *self) {
@@ -153,14 +197,17 @@ void on_drag_update (GtkGestureDrag *gesture, double offset_x, double offset_y,
     } else if (self->drag_type == DRAG_TYPE_IMAGE_MOVE && self->selected_layer) {
         self->selected_layer->x = CLAMP(self->drag_obj_start_x + dx, 0.0, 1.0);
         self->selected_layer->y = CLAMP(self->drag_obj_start_y + dy, 0.0, 1.0);
+        meme_layer_mark_dirty(self->selected_layer, MEME_LAYER_DIRTY_GEOMETRY);
     } else if (self->drag_type == DRAG_TYPE_IMAGE_RESIZE && self->selected_layer) {
         double cx = self->selected_layer->x * img_w, cy = self->selected_layer->y * img_h;
         double sdx = self->drag_start_x - cx, sdy = self->drag_start_y - cy;
         double cdx = (self->drag_start_x + offset_x/s) - cx, cdy = (self->drag_start_y + offset_y/s) - cy;
         double dist_s = sqrt(sdx*sdx + sdy*sdy), dist_c = sqrt(cdx*cdx + cdy*cdy);
-        if (dist_s > 5.0) self->selected_layer->scale = CLAMP(self->drag_obj_start_scale * (dist_c/dist_s), 0.1, 5.0);
-        if (self->selected_layer->type == LAYER_TYPE_TEXT) {
-            self->selected_layer->pixbuf = NULL;
+        if (dist_s > 5.0) {
+            if (self->selected_layer->type == LAYER_TYPE_TEXT)
+                defer_text_rewrap(self);
+            self->selected_layer->scale = CLAMP(self->drag_obj_start_scale * (dist_c/dist_s), 0.1, 5.0);
+            meme_layer_mark_dirty(self->selected_layer, MEME_LAYER_DIRTY_GEOMETRY);
         }
     }
 
@@ -172,42 +219,66 @@ void on_drag_update (GtkGestureDrag *gesture, double offset_x, double offset_y,
 }
 
 void on_drag_end (GtkGestureDrag *g, double x, double y, MemeWindow *self) { 
+    meme_window_end_drag_session(self);
+    if (self->drag_type == DRAG_TYPE_IMAGE_MOVE || self->drag_type == DRAG_TYPE_IMAGE_RESIZE)
+        meme_history_commit(self->history, self->layers);
     self->drag_type = DRAG_TYPE_NONE; 
     render_meme(self);
 }
 
-void free_history_stack (GList **stack) {
-    GList *l;
-    for (l = *stack; l != NULL; l = l->next) meme_layer_list_free ((GList *)l->data);
-    g_list_free (*stack);
-    *stack = NULL;
+// The pointer grab was lost: put the layer back where the drag started.
+void on_drag_cancel (GtkGesture *g, GdkEventSequence *sequence, MemeWindow *self) {
+    guint id;
+
+    if (self->drag_type != DRAG_TYPE_IMAGE_MOVE && self->drag_type != DRAG_TYPE_IMAGE_RESIZE) return;
+    id = self->selected_layer ? self->selected_layer->id : 0;
+    self->drag_type = DRAG_TYPE_NONE;
+    meme_window_end_drag_session(self);
+    meme_history_abort(self->history, self->layers);
+    self->selected_layer = meme_layer_store_find(self->layers, id);
+    sync_ui_with_layer(self);
+    render_meme(self);
+}
+
+void meme_window_end_drag_session (MemeWindow *self) {
+    g_clear_pointer (&self->drag_session, meme_drag_session_free);
+    g_clear_handle_id (&self->text_settle_id, g_source_remove);
+    if (self->drag_type == DRAG_TYPE_IMAGE_RESIZE && self->selected_layer)
+        rewrap_text (self, self->selected_layer, 0.0);
 }
 
 void push_undo (MemeWindow *self) {
-    free_history_stack (&self->redo_stack);
-    if (g_list_length (self->undo_stack) >= 20) {
-        GList *last = g_list_last (self->undo_stack);
-        meme_layer_list_free ((GList *)last->data);
-        self->undo_stack = g_list_delete_link (self->undo_stack, last);
-    }
-    self->undo_stack = g_list_prepend (self->undo_stack, meme_layer_list_copy (self->layers));
+    meme_window_commit_edit (self);
+    meme_history_push (self->history, self->layers);
 }
 
 void myapp_window_perform_undo(MemeWindow *self) {
-    if (!self->undo_stack) return;
-    self->redo_stack = g_list_prepend (self->redo_stack, self->layers);
-    self->layers = (GList *)self->undo_stack->data;
-    self->undo_stack = g_list_delete_link (self->undo_stack, self->undo_stack);
+    MemeTemplateOp op;
+
+    meme_window_commit_edit (self);
+    if (!meme_history_can_undo (self->history)) return;
+    meme_window_end_drag_session (self);
+    meme_history_undo (self->history, self->layers, &op);
+    if (op.type != MEME_TEMPLATE_OP_NONE)
+        meme_window_revert_template_op (self, &op);
+    if (self->crop_session_ops)
+        self->crop_session_ops--;
     self->selected_layer = NULL;
     sync_ui_with_layer (self);
     render_meme (self);
 }
 
 void myapp_window_perform_redo (MemeWindow *self) {
-    if (!self->redo_stack) return;
-    self->undo_stack = g_list_prepend (self->undo_stack, self->layers);
-    self->layers = (GList *)self->redo_stack->data;
-    self->redo_stack = g_list_delete_link (self->redo_stack, self->redo_stack);
+    MemeTemplateOp op;
+
+    meme_window_commit_edit (self);
+    if (!meme_history_can_redo (self->history)) return;
+    meme_window_end_drag_session (self);
+    meme_history_redo (self->history, self->layers, &op);
+    if (op.type != MEME_TEMPLATE_OP_NONE)
+        meme_window_apply_template_op (self, &op);
+    if (gtk_toggle_button_get_active (self->crop_mode_button))
+        self->crop_session_ops++;
     self->selected_layer = NULL;
     sync_ui_with_layer (self);
     render_meme (self);
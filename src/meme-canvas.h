@@ -24,6 +24,7 @@ void on_mouse_move (GtkEventControllerMotion *controller, double x, double y, Me
 void on_drag_begin (GtkGestureDrag *gesture, double x, double y, MemeWindow *self);
 void on_drag_update (GtkGestureDrag *gesture, double offset_x, double offset_y, MemeWindow *self);
 void on_drag_end (GtkGestureDrag *g, double x, double y, MemeWindow *self);
+void on_drag_cancel (GtkGesture *g, GdkEventSequence *sequence, MemeWindow *self);
+void meme_window_end_drag_session (MemeWindow *self);
 
-void free_history_stack (GList **stack);
 void push_undo (MemeWindow *self);
\ No newline at end of file
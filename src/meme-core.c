@@ -1,5 +1,53 @@
 #include "meme-core.h"
+#include "meme-effects.h"
+#include "config.h"
+#ifdef MEME_MAGICK_EFFECTS
 #include <MagickWand/MagickWand.h>
+#endif
+
+// Deep fry recipe: quarter-resolution blocks, a bit of grain, then the
+// saturation/contrast blowout (ImageMagick's modulate 300 and contrast 80).
+#define DEEP_FRY_BLOCK      4
+#define DEEP_FRY_NOISE      12
+#define DEEP_FRY_SATURATION 3.0
+#define DEEP_FRY_CONTRAST   80.0
+
+// Layers are only edited from the main thread.
+static guint64 layer_generation_counter;
+// Id of the layer that took each of the last MEME_LAYER_CHANGE_LOG generations.
+static guint layer_change_log[MEME_LAYER_CHANGE_LOG];
+
+ImageLayer *meme_layer_new (LayerType type) {
+    ImageLayer *layer = g_new0 (ImageLayer, 1);
+    layer->type = type;
+    layer->wrap_width = 0.9;
+    layer->fit_lines = 2;
+    meme_layer_mark_dirty (layer, MEME_LAYER_DIRTY_GEOMETRY | MEME_LAYER_DIRTY_APPEARANCE |
+                                  MEME_LAYER_DIRTY_CONTENT);
+    return layer;
+}
+
+// Call after changing any field of `layer`.
+void meme_layer_mark_dirty (ImageLayer *layer, MemeLayerDirty what) {
+    layer->dirty |= what;
+    layer->generation = ++layer_generation_counter;
+    layer_change_log[layer->generation % MEME_LAYER_CHANGE_LOG] = layer->id;
+    if (what & MEME_LAYER_DIRTY_CONTENT)
+        layer->content_generation = layer->generation;
+}
+
+// The newest generation handed out; unchanged means no layer was touched.
+guint64 meme_layer_generation_now (void) {
+    return layer_generation_counter;
+}
+
+/* Id of the layer that was given `generation`, which must be one of the
+ * last MEME_LAYER_CHANGE_LOG handed out. Lets a caller that remembers the
+ * counter find just the layers touched since. */
+guint meme_layer_changed_id (guint64 generation) {
+    g_return_val_if_fail (generation + MEME_LAYER_CHANGE_LOG > layer_generation_counter, 0);
+    return layer_change_log[generation % MEME_LAYER_CHANGE_LOG];
+}
 
 ImageLayer * meme_layer_copy (const ImageLayer *src) {
     ImageLayer *dst = g_new0 (ImageLayer, 1);
@@ -20,19 +68,61 @@ void meme_layer_free (gpointer data) {
   }
 }
 
-GList * meme_layer_list_copy (GList *src) {
-    GList *dst = NULL;
-    GList *l;
-    for (l = src; l != NULL; l = l->next) {
-        dst = g_list_append (dst, meme_layer_copy ((ImageLayer *)l->data));
+// Returns a new pixbuf; crops are clamped to `src`.
+GdkPixbuf *meme_template_op_apply (const MemeTemplateOp *op, GdkPixbuf *src) {
+    int w = gdk_pixbuf_get_width (src);
+    int h = gdk_pixbuf_get_height (src);
+    int cx, cy;
+    GdkPixbuf *sub, *copy;
+
+    switch (op->type) {
+        case MEME_TEMPLATE_OP_ROTATE_CW:
+            return gdk_pixbuf_rotate_simple (src, GDK_PIXBUF_ROTATE_CLOCKWISE);
+        case MEME_TEMPLATE_OP_ROTATE_CCW:
+            return gdk_pixbuf_rotate_simple (src, GDK_PIXBUF_ROTATE_COUNTERCLOCKWISE);
+        case MEME_TEMPLATE_OP_FLIP_H:
+            return gdk_pixbuf_flip (src, TRUE);
+        case MEME_TEMPLATE_OP_FLIP_V:
+            return gdk_pixbuf_flip (src, FALSE);
+        case MEME_TEMPLATE_OP_CROP:
+            cx = CLAMP (op->x, 0, w - 1);
+            cy = CLAMP (op->y, 0, h - 1);
+            sub = gdk_pixbuf_new_subpixbuf (src, cx, cy, CLAMP (op->width, 1, w - cx), CLAMP (op->height, 1, h - cy));
+            copy = gdk_pixbuf_copy (sub);
+            g_object_unref (sub);
+            return copy;
+        case MEME_TEMPLATE_OP_NONE:
+        default:
+            return g_object_ref (src);
     }
-    return dst;
 }
 
-void meme_layer_list_free (GList *list) {
-    g_list_free_full (list, (GDestroyNotify)meme_layer_free);
+// Rotations and flips undo exactly; a crop can only be replayed from the source.
+gboolean meme_template_op_invert (const MemeTemplateOp *op, MemeTemplateOp *inverse) {
+    *inverse = *op;
+    switch (op->type) {
+        case MEME_TEMPLATE_OP_ROTATE_CW: inverse->type = MEME_TEMPLATE_OP_ROTATE_CCW; return TRUE;
+        case MEME_TEMPLATE_OP_ROTATE_CCW: inverse->type = MEME_TEMPLATE_OP_ROTATE_CW; return TRUE;
+        case MEME_TEMPLATE_OP_FLIP_H:
+        case MEME_TEMPLATE_OP_FLIP_V: return TRUE;
+        case MEME_TEMPLATE_OP_NONE:
+        case MEME_TEMPLATE_OP_CROP:
+        default: return FALSE;
+    }
+}
+
+// Applies every MemeTemplateOp in `ops` to `src`, taking ownership of it.
+GdkPixbuf *meme_template_ops_replay (GdkPixbuf *src, const GArray *ops) {
+    for (guint i = 0; ops && i < ops->len; i++) {
+        GdkPixbuf *next = meme_template_op_apply (&g_array_index (ops, MemeTemplateOp, i), src);
+
+        g_object_unref (src);
+        src = next;
+    }
+    return src;
 }
 
+#ifdef MEME_MAGICK_EFFECTS
 static MagickWand *pixbuf_to_wand(GdkPixbuf *pb) {
     int w = gdk_pixbuf_get_width(pb);
     int h = gdk_pixbuf_get_height(pb);
@@ -90,22 +180,29 @@ GdkPixbuf *meme_core_apply_saturation_contrast(GdkPixbuf *src, double sat, doubl
     return out;
 }
 
-GdkPixbuf *meme_core_apply_deep_fry(GdkPixbuf *src) {
+GdkPixbuf *meme_core_apply_deep_fry(GdkPixbuf *src, guint32 seed) {
     MagickWand *wand;
     int w, h;
-    GdkPixbuf *out;
+    GdkPixbuf *out, *blocky;
 
     MagickWandGenesis();
     wand = pixbuf_to_wand(src);
     w = MagickGetImageWidth(wand);
     h = MagickGetImageHeight(wand);
 
-    MagickResizeImage(wand, MAX(w / 4, 1), MAX(h / 4, 1), PointFilter);
+    MagickResizeImage(wand, MAX(w / DEEP_FRY_BLOCK, 1), MAX(h / DEEP_FRY_BLOCK, 1), PointFilter);
     MagickResizeImage(wand, w, h, PointFilter);
 
-    MagickAddNoiseImage(wand, LaplacianNoise, 1.5);
-    MagickModulateImage(wand, 100.0, 300.0, 100.0);
-    MagickBrightnessContrastImage(wand, 0.0, 80.0);
+    // MagickAddNoiseImage() can't be seeded, use the native grain instead
+    blocky = wand_to_pixbuf(wand);
+    DestroyMagickWand(wand);
+    meme_fx_noise(gdk_pixbuf_get_pixels(blocky), w, h, gdk_pixbuf_get_rowstride(blocky),
+                  gdk_pixbuf_get_n_channels(blocky), DEEP_FRY_NOISE, seed);
+    wand = pixbuf_to_wand(blocky);
+    g_object_unref(blocky);
+
+    MagickModulateImage(wand, 100.0, DEEP_FRY_SATURATION * 100.0, 100.0);
+    MagickBrightnessContrastImage(wand, 0.0, DEEP_FRY_CONTRAST);
 
     out = wand_to_pixbuf(wand);
     DestroyMagickWand(wand);
@@ -130,33 +227,118 @@ meme_core_apply_black_and_white(GdkPixbuf *src)
     return out;
 }
 
+void meme_core_apply_effects_in_place(GdkPixbuf *pixbuf, double scale,
+                                      gboolean bw, gboolean cinematic, gboolean deep_fry, guint32 seed) {
+    GdkPixbuf *result = g_object_ref(pixbuf);
 
-GdkPixbuf *meme_core_apply_effects(GdkPixbuf *composite, gboolean cinematic, gboolean deep_fry) {
-    GdkPixbuf *result;
-    gboolean own;
-
-    if (!cinematic && !deep_fry) {
-        g_object_ref(composite);
-        return composite;
+    // far too slow for the interactive preview, only B&W stays live there
+    if (scale < 1.0) {
+        cinematic = FALSE;
+        deep_fry = FALSE;
     }
 
-    result = composite;
-    own = FALSE;
-
+    if (bw) {
+        GdkPixbuf *tmp = meme_core_apply_black_and_white(result);
+        g_object_unref(result);
+        result = tmp;
+    }
     if (cinematic) {
-        GdkPixbuf *tmp = meme_core_apply_saturation_contrast(result, 1.15, 1.05);
-        if (own) g_object_unref(result);
+        GdkPixbuf *tmp = meme_core_apply_saturation_contrast(result, MEME_CINEMATIC_SATURATION, MEME_CINEMATIC_CONTRAST);
+        g_object_unref(result);
         result = tmp;
-        own = TRUE;
     }
-
     if (deep_fry) {
-        GdkPixbuf *tmp = meme_core_apply_deep_fry(result);
-        if (own) g_object_unref(result);
+        GdkPixbuf *tmp = meme_core_apply_deep_fry(result, seed);
+        g_object_unref(result);
         result = tmp;
-        own = TRUE;
     }
 
-    if (!own) g_object_ref(result);
+    if (result != pixbuf)
+        gdk_pixbuf_copy_area(result, 0, 0, gdk_pixbuf_get_width(pixbuf), gdk_pixbuf_get_height(pixbuf),
+                             pixbuf, 0, 0);
+    g_object_unref(result);
+}
+#else
+GdkPixbuf *meme_core_apply_saturation_contrast(GdkPixbuf *src, double sat, double contrast) {
+    GdkPixbuf *out = gdk_pixbuf_copy(src);
+
+    // contrast is the old MagickBrightnessContrastImage() knob, keep its curve
+    meme_fx_saturation_contrast(gdk_pixbuf_get_pixels(out),
+                                gdk_pixbuf_get_width(out), gdk_pixbuf_get_height(out),
+                                gdk_pixbuf_get_rowstride(out), gdk_pixbuf_get_n_channels(out),
+                                sat, meme_fx_contrast_from_magick((contrast - 1.0) * 50.0));
+    return out;
+}
+
+static void effect_chain_add_deep_fry(MemeFxChain *chain, guint32 seed) {
+    meme_fx_chain_pixelate(chain, DEEP_FRY_BLOCK);
+    meme_fx_chain_noise(chain, DEEP_FRY_NOISE, seed);
+    meme_fx_chain_saturation(chain, DEEP_FRY_SATURATION);
+    meme_fx_chain_contrast(chain, meme_fx_contrast_from_magick(DEEP_FRY_CONTRAST));
+}
+
+static void run_effect_chain(const MemeFxChain *chain, GdkPixbuf *pixbuf, double scale) {
+    meme_fx_chain_run(chain, gdk_pixbuf_get_pixels(pixbuf),
+                      gdk_pixbuf_get_width(pixbuf), gdk_pixbuf_get_height(pixbuf),
+                      gdk_pixbuf_get_rowstride(pixbuf), gdk_pixbuf_get_n_channels(pixbuf), scale);
+}
+
+GdkPixbuf *meme_core_apply_deep_fry(GdkPixbuf *src, guint32 seed) {
+    GdkPixbuf *out = gdk_pixbuf_copy(src);
+    MemeFxChain chain;
+
+    meme_fx_chain_init(&chain);
+    effect_chain_add_deep_fry(&chain, seed);
+    run_effect_chain(&chain, out, 1.0);
+    return out;
+}
+
+GdkPixbuf *
+meme_core_apply_black_and_white(GdkPixbuf *src)
+{
+    GdkPixbuf *out = gdk_pixbuf_copy(src);
+
+    meme_fx_grayscale(gdk_pixbuf_get_pixels(out),
+                      gdk_pixbuf_get_width(out), gdk_pixbuf_get_height(out),
+                      gdk_pixbuf_get_rowstride(out), gdk_pixbuf_get_n_channels(out));
+    return out;
+}
+
+// All enabled filters compile into one chain: the pixelate and noise
+// stages of deep fry run first, every colour op after them in one pass.
+// Pixelation commutes with per-pixel ops; the grain now goes in before B&W
+// and cinematic instead of between them. `scale` is the size of `pixbuf`
+// relative to the full-size meme, the fast preview passes < 1. The grain
+// only depends on `seed` and the pixel position, so equal inputs always
+// give identical output.
+void meme_core_apply_effects_in_place(GdkPixbuf *pixbuf, double scale,
+                                      gboolean bw, gboolean cinematic, gboolean deep_fry, guint32 seed) {
+    MemeFxChain chain;
+
+    meme_fx_chain_init(&chain);
+    if (bw)
+        meme_fx_chain_grayscale(&chain);
+    if (cinematic) {
+        meme_fx_chain_saturation(&chain, MEME_CINEMATIC_SATURATION);
+        meme_fx_chain_contrast(&chain, meme_fx_contrast_from_magick((MEME_CINEMATIC_CONTRAST - 1.0) * 50.0));
+    }
+    if (deep_fry)
+        effect_chain_add_deep_fry(&chain, seed);
+
+    if (!meme_fx_chain_is_identity(&chain))
+        run_effect_chain(&chain, pixbuf, scale);
+}
+#endif
+
+GdkPixbuf *meme_core_apply_effects(GdkPixbuf *composite, gboolean cinematic, gboolean deep_fry, guint32 seed) {
+    GdkPixbuf *result;
+
+    if (!cinematic && !deep_fry) {
+        g_object_ref(composite);
+        return composite;
+    }
+
+    result = gdk_pixbuf_copy(composite);
+    meme_core_apply_effects_in_place(result, 1.0, FALSE, cinematic, deep_fry, seed);
     return result;
 }
@@ -33,12 +33,36 @@ typedef enum {
   BLEND_OVERLAY
 } BlendMode;
 
+// A rotate, flip or crop of the template and of every GIF frame with it.
+// The undo history keeps these instead of the pixels they produced.
+typedef enum {
+  MEME_TEMPLATE_OP_NONE,
+  MEME_TEMPLATE_OP_ROTATE_CW,
+  MEME_TEMPLATE_OP_ROTATE_CCW,
+  MEME_TEMPLATE_OP_FLIP_H,
+  MEME_TEMPLATE_OP_FLIP_V,
+  MEME_TEMPLATE_OP_CROP
+} MemeTemplateOpType;
+
+typedef struct {
+  MemeTemplateOpType type;
+  int x, y, width, height;     // crop rectangle in pixels
+} MemeTemplateOp;
+
 typedef enum {
   LAYER_TYPE_IMAGE,
   LAYER_TYPE_TEXT
 } LayerType;
 
+// What changed on a layer since the editor last snapshotted it.
+typedef enum {
+  MEME_LAYER_DIRTY_GEOMETRY   = 1 << 0,  // x, y, scale, rotation
+  MEME_LAYER_DIRTY_APPEARANCE = 1 << 1,  // opacity, blend mode
+  MEME_LAYER_DIRTY_CONTENT    = 1 << 2   // pixbuf, text, font, colours
+} MemeLayerDirty;
+
 typedef struct {
+  guint id;                    // unique within a MemeLayerStore, kept by copies
   LayerType type;
   GdkPixbuf *pixbuf;
   char *text;
@@ -54,15 +78,39 @@ typedef struct {
   BlendMode blend_mode;
   GdkRGBA text_color;
   GdkRGBA stroke_color;
+  double text_wrap_scale;      // pins the wrap width during a resize, 0 follows `scale`
+  double wrap_width;           // fraction of the template width text wraps to
+  gboolean auto_fit;           // font_size follows the text: the largest that wraps into fit_lines
+  int fit_lines;
+
+  /* Change tracking. Generations come from one counter, so equal numbers
+   * mean equal state even across copies (undo, scenes) and caches can key
+   * on them. Only meme_layer_mark_dirty() touches these. */
+  guint dirty;                 // MemeLayerDirty bits, cleared when a scene is built
+  guint64 generation;          // bumped on every change
+  guint64 content_generation;  // bumped on MEME_LAYER_DIRTY_CONTENT only
 } ImageLayer;
 
 
+ImageLayer *meme_layer_new (LayerType type);
+void meme_layer_mark_dirty (ImageLayer *layer, MemeLayerDirty what);
+guint64 meme_layer_generation_now (void);
+#define MEME_LAYER_CHANGE_LOG 64
+guint meme_layer_changed_id (guint64 generation);
 ImageLayer *meme_layer_copy (const ImageLayer *src);
 void meme_layer_free (gpointer data);
-GList *meme_layer_list_copy (GList *src);
-void meme_layer_list_free (GList *list);
 
-GdkPixbuf *meme_core_apply_effects(GdkPixbuf *composite, gboolean cinematic, gboolean deep_fry);
+GdkPixbuf *meme_template_op_apply (const MemeTemplateOp *op, GdkPixbuf *src);
+gboolean meme_template_op_invert (const MemeTemplateOp *op, MemeTemplateOp *inverse);
+GdkPixbuf *meme_template_ops_replay (GdkPixbuf *src, const GArray *ops);
+
+// Cinematic look: a saturation boost plus the old MagickBrightnessContrastImage() knob.
+#define MEME_CINEMATIC_SATURATION 1.15
+#define MEME_CINEMATIC_CONTRAST   1.05
+
+GdkPixbuf *meme_core_apply_effects(GdkPixbuf *composite, gboolean cinematic, gboolean deep_fry, guint32 seed);
+void meme_core_apply_effects_in_place(GdkPixbuf *pixbuf, double scale,
+                                      gboolean bw, gboolean cinematic, gboolean deep_fry, guint32 seed);
 GdkPixbuf *meme_core_apply_saturation_contrast(GdkPixbuf *src, double sat, double contrast);
-GdkPixbuf *meme_core_apply_deep_fry(GdkPixbuf *src);
+GdkPixbuf *meme_core_apply_deep_fry(GdkPixbuf *src, guint32 seed);
 GdkPixbuf *meme_core_apply_black_and_white (GdkPixbuf *src);
@@ -0,0 +1,527 @@
+/* meme-effects.c
+ *
+ * Copyright 2025 Giovanni
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#include "meme-effects.h"
+#include <math.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MEME_FX_X86 1
+#include <immintrin.h>
+#endif
+
+// Rec. 601 luma, same weights as the old 306/601/117 fixed-point code.
+#define LUMA_R 0.299f
+#define LUMA_G 0.587f
+#define LUMA_B 0.114f
+
+static MemeFxIsa detect_isa (void) {
+    MemeFxIsa isa = MEME_FX_ISA_SCALAR;
+    const char *forced;
+
+#ifdef MEME_FX_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("sse2")) isa = MEME_FX_ISA_SSE2;
+    if (__builtin_cpu_supports ("avx2")) isa = MEME_FX_ISA_AVX2;
+#endif
+
+    // Handy to compare paths against the scalar reference without
+    // rebuilding. It can only lower the level, never enable missing ISAs.
+    forced = g_getenv ("MEMERIST_FX_ISA");
+    if (forced) {
+        if (g_ascii_strcasecmp (forced, "scalar") == 0) isa = MEME_FX_ISA_SCALAR;
+        else if (g_ascii_strcasecmp (forced, "sse2") == 0 && isa > MEME_FX_ISA_SSE2) isa = MEME_FX_ISA_SSE2;
+    }
+    return isa;
+}
+
+MemeFxIsa meme_fx_get_isa (void) {
+    static gsize isa_once = 0;
+
+    // +1 because g_once_init_leave() refuses 0, which is ISA_SCALAR
+    if (g_once_init_enter (&isa_once))
+        g_once_init_leave (&isa_once, (gsize) detect_isa () + 1);
+    return (MemeFxIsa) (isa_once - 1);
+}
+
+const char *meme_fx_isa_name (MemeFxIsa isa) {
+    switch (isa) {
+        case MEME_FX_ISA_SSE2: return "sse2";
+        case MEME_FX_ISA_AVX2: return "avx2";
+        case MEME_FX_ISA_SCALAR: return "scalar";
+        default: return "scalar";
+    }
+}
+
+// Slope ImageMagick's BrightnessContrast uses for a contrast percentage,
+// so the native filters keep the look of the old MagickWand ones.
+double meme_fx_contrast_from_magick (double contrast_percent) {
+    double slope = tan (G_PI * (contrast_percent / 100.0 + 1.0) / 4.0);
+    return slope < 0.0 ? 0.0 : slope;
+}
+
+static inline guchar clamp_round (float v) {
+    if (v <= 0.0f) return 0;
+    if (v >= 255.0f) return 255;
+    return (guchar) (int) (v + 0.5f);
+}
+
+static void color_matrix_row_scalar (guchar *row, int width, int n_channels, const MemeFxMatrix *mx) {
+    int x;
+
+    for (x = 0; x < width; x++) {
+        guchar *p = row + x * n_channels;
+        float r = p[0], g = p[1], b = p[2];
+
+        p[0] = clamp_round (mx->m[0][0] * r + mx->m[0][1] * g + mx->m[0][2] * b + mx->offset[0]);
+        p[1] = clamp_round (mx->m[1][0] * r + mx->m[1][1] * g + mx->m[1][2] * b + mx->offset[1]);
+        p[2] = clamp_round (mx->m[2][0] * r + mx->m[2][1] * g + mx->m[2][2] * b + mx->offset[2]);
+    }
+}
+
+#ifdef MEME_FX_X86
+/* The vector paths split RGBA words into R, G and B lanes, run exactly the
+ * scalar float expression (same operand order, no FMA) and pack the result
+ * back over the untouched alpha byte. */
+
+__attribute__((target ("sse2")))
+static void color_matrix_row_sse2 (guchar *row, int width, const MemeFxMatrix *mx) {
+    const __m128i mask = _mm_set1_epi32 (0xff);
+    const __m128i alpha_mask = _mm_set1_epi32 ((int) 0xff000000u);
+    const __m128 zero = _mm_setzero_ps (), top = _mm_set1_ps (255.0f), half = _mm_set1_ps (0.5f);
+    __m128 m[3][3], off[3];
+    int x, i, j;
+
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++) m[i][j] = _mm_set1_ps (mx->m[i][j]);
+        off[i] = _mm_set1_ps (mx->offset[i]);
+    }
+
+    for (x = 0; x + 4 <= width; x += 4) {
+        __m128i px = _mm_loadu_si128 ((const __m128i *) (row + x * 4));
+        __m128 r = _mm_cvtepi32_ps (_mm_and_si128 (px, mask));
+        __m128 g = _mm_cvtepi32_ps (_mm_and_si128 (_mm_srli_epi32 (px, 8), mask));
+        __m128 b = _mm_cvtepi32_ps (_mm_and_si128 (_mm_srli_epi32 (px, 16), mask));
+        __m128i out = _mm_and_si128 (px, alpha_mask);
+
+        for (i = 0; i < 3; i++) {
+            __m128 v = _mm_add_ps (_mm_add_ps (_mm_add_ps (_mm_mul_ps (m[i][0], r),
+                                                           _mm_mul_ps (m[i][1], g)),
+                                               _mm_mul_ps (m[i][2], b)),
+                                   off[i]);
+            __m128i c = _mm_cvttps_epi32 (_mm_add_ps (_mm_min_ps (_mm_max_ps (v, zero), top), half));
+            out = _mm_or_si128 (out, _mm_slli_epi32 (c, i * 8));
+        }
+        _mm_storeu_si128 ((__m128i *) (row + x * 4), out);
+    }
+    color_matrix_row_scalar (row + x * 4, width - x, 4, mx);
+}
+
+__attribute__((target ("avx2")))
+static void color_matrix_row_avx2 (guchar *row, int width, const MemeFxMatrix *mx) {
+    const __m256i mask = _mm256_set1_epi32 (0xff);
+    const __m256i alpha_mask = _mm256_set1_epi32 ((int) 0xff000000u);
+    const __m256 zero = _mm256_setzero_ps (), top = _mm256_set1_ps (255.0f), half = _mm256_set1_ps (0.5f);
+    __m256 m[3][3], off[3];
+    int x, i, j;
+
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++) m[i][j] = _mm256_set1_ps (mx->m[i][j]);
+        off[i] = _mm256_set1_ps (mx->offset[i]);
+    }
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        __m256i px = _mm256_loadu_si256 ((const __m256i *) (row + x * 4));
+        __m256 r = _mm256_cvtepi32_ps (_mm256_and_si256 (px, mask));
+        __m256 g = _mm256_cvtepi32_ps (_mm256_and_si256 (_mm256_srli_epi32 (px, 8), mask));
+        __m256 b = _mm256_cvtepi32_ps (_mm256_and_si256 (_mm256_srli_epi32 (px, 16), mask));
+        __m256i out = _mm256_and_si256 (px, alpha_mask);
+
+        for (i = 0; i < 3; i++) {
+            __m256 v = _mm256_add_ps (_mm256_add_ps (_mm256_add_ps (_mm256_mul_ps (m[i][0], r),
+                                                                    _mm256_mul_ps (m[i][1], g)),
+                                                     _mm256_mul_ps (m[i][2], b)),
+                                      off[i]);
+            __m256i c = _mm256_cvttps_epi32 (_mm256_add_ps (_mm256_min_ps (_mm256_max_ps (v, zero), top), half));
+            out = _mm256_or_si256 (out, _mm256_slli_epi32 (c, i * 8));
+        }
+        _mm256_storeu_si256 ((__m256i *) (row + x * 4), out);
+    }
+    color_matrix_row_scalar (row + x * 4, width - x, 4, mx);
+}
+#endif
+
+static inline void color_matrix_row (guchar *row, int width, int n_channels, MemeFxIsa isa,
+                                     const MemeFxMatrix *mx) {
+    switch (isa) {
+#ifdef MEME_FX_X86
+        case MEME_FX_ISA_AVX2: color_matrix_row_avx2 (row, width, mx); break;
+        case MEME_FX_ISA_SSE2: color_matrix_row_sse2 (row, width, mx); break;
+#else
+        case MEME_FX_ISA_AVX2:
+        case MEME_FX_ISA_SSE2:
+#endif
+        case MEME_FX_ISA_SCALAR:
+        default:
+            color_matrix_row_scalar (row, width, n_channels, mx);
+            break;
+    }
+}
+
+static void apply_color_matrix (guchar *pixels, int width, int height, int rowstride, int n_channels,
+                                const MemeFxMatrix *mx) {
+    MemeFxIsa isa = (n_channels == 4) ? meme_fx_get_isa () : MEME_FX_ISA_SCALAR;
+    int y;
+
+    for (y = 0; y < height; y++)
+        color_matrix_row (pixels + (gsize) y * rowstride, width, n_channels, isa, mx);
+}
+
+void meme_fx_grayscale (guchar *pixels, int width, int height, int rowstride, int n_channels) {
+    MemeFxMatrix mx = { { { LUMA_R, LUMA_G, LUMA_B },
+                          { LUMA_R, LUMA_G, LUMA_B },
+                          { LUMA_R, LUMA_G, LUMA_B } },
+                        { 0.0f, 0.0f, 0.0f } };
+
+    apply_color_matrix (pixels, width, height, rowstride, n_channels, &mx);
+}
+
+// Saturation mixes each channel with the pixel's luma, contrast is a
+// linear stretch around mid grey. Both are linear, so they fold into one
+// matrix and the buffer is only walked once.
+void meme_fx_saturation_contrast (guchar *pixels, int width, int height, int rowstride, int n_channels,
+                                  double sat, double contrast) {
+    const float luma[3] = { LUMA_R, LUMA_G, LUMA_B };
+    MemeFxMatrix mx;
+    int i, j;
+
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++) {
+            double s = (1.0 - sat) * luma[j] + (i == j ? sat : 0.0);
+            mx.m[i][j] = (float) (contrast * s);
+        }
+        mx.offset[i] = (float) (128.0 * (1.0 - contrast));
+    }
+    apply_color_matrix (pixels, width, height, rowstride, n_channels, &mx);
+}
+
+// Source pixel under the centre of each of `n` output pixels of a buffer
+// rendered at `scale`. Spatial effects work on these coordinates so the
+// preview shows the same blocks and grain as the full-size export.
+static int *source_coords (int n, double scale) {
+    int *map = g_new (int, MAX (n, 1));
+    int i;
+
+    for (i = 0; i < n; i++)
+        map[i] = (scale == 1.0) ? i : (int) floor ((i + 0.5) / scale);
+    return map;
+}
+
+// Each column's block is the run of columns whose source pixel falls in
+// the same block; every column samples the middle column of its run.
+static int *block_centres (const int *src, int n, int block) {
+    int *mid = g_new (int, MAX (n, 1));
+    int start, len, i;
+
+    for (start = 0; start < n; start += len) {
+        for (len = 1; start + len < n && src[start + len] / block == src[start] / block; len++)
+            ;
+        for (i = 0; i < len; i++)
+            mid[start + i] = start + len / 2;
+    }
+    return mid;
+}
+
+// Pixelates rows that all fall into the same block row: the middle row is
+// pixelated in place, then copied over the others. Reading mid_x[x] is
+// safe in place since a run's middle only ever receives its own value.
+static void pixelate_band (guchar *band, int width, int height, int rowstride, int n_channels,
+                           const int *mid_x) {
+    guchar *src_row = band + (gsize) (height / 2) * rowstride;
+    int x, y, c;
+
+    if (n_channels == 4) {
+        for (x = 0; x < width; x++) {
+            guint32 v;
+            memcpy (&v, src_row + mid_x[x] * 4, 4);
+            memcpy (src_row + x * 4, &v, 4);
+        }
+    } else {
+        for (x = 0; x < width; x++)
+            for (c = 0; c < n_channels; c++)
+                src_row[x * n_channels + c] = src_row[mid_x[x] * n_channels + c];
+    }
+
+    for (y = 0; y < height; y++) {
+        guchar *dst = band + (gsize) y * rowstride;
+        if (dst != src_row) memcpy (dst, src_row, (gsize) width * n_channels);
+    }
+}
+
+
+/* Grain is counter based: the offsets of a pixel are a hash of the seed
+ * and its source coordinates, so any row, tile or thread can produce its
+ * share on its own and the same seed always gives the same picture. */
+static inline guint32 fmix32 (guint32 h) {
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h;
+}
+
+// fmix32 is a bijection, so keying each row once and adding the column
+// gives every pixel of a row a distinct hash.
+static inline guint32 noise_row_key (guint32 seed, int src_y) {
+    return fmix32 (seed ^ ((guint32) src_y * 0x9E3779B9u));
+}
+
+static void noise_add_scalar (guchar *row, int width, int n_channels, const gint8 *noise) {
+    int x, c;
+
+    for (x = 0; x < width; x++) {
+        guchar *p = row + x * n_channels;
+        for (c = 0; c < 3; c++) {
+            int v = p[c] + noise[x * 4 + c];
+            p[c] = (guchar) CLAMP (v, 0, 255);
+        }
+    }
+}
+
+#ifdef MEME_FX_X86
+// Flipping the top bit turns 0..255 into -128..127, where a signed
+// saturating add is exactly CLAMP (p + n, 0, 255) once flipped back.
+__attribute__((target ("sse2")))
+static void noise_add_sse2 (guchar *row, int width, const gint8 *noise) {
+    const __m128i bias = _mm_set1_epi8 ((char) 0x80);
+    int x;
+
+    for (x = 0; x + 4 <= width; x += 4) {
+        __m128i px = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) (row + x * 4)), bias);
+        __m128i n = _mm_loadu_si128 ((const __m128i *) (noise + x * 4));
+        _mm_storeu_si128 ((__m128i *) (row + x * 4), _mm_xor_si128 (_mm_adds_epi8 (px, n), bias));
+    }
+    noise_add_scalar (row + x * 4, width - x, 4, noise + x * 4);
+}
+#endif
+
+// Hashes the row's source pixels into signed RGB offsets in `scratch`
+// (width * 4 bytes, alpha offset 0), then adds them to the row.
+static void noise_fill_scalar (gint8 *scratch, int width, guint32 key, const int *src_x, int amplitude) {
+    guint32 span = (guint32) amplitude * 2 + 1;
+    int x, c;
+
+    for (x = 0; x < width; x++) {
+        guint32 h = fmix32 (key + (guint32) src_x[x]);
+        for (c = 0; c < 3; c++)
+            scratch[x * 4 + c] = (gint8) ((int) ((((h >> (c * 8)) & 0xff) * span) >> 8) - amplitude);
+        scratch[x * 4 + 3] = 0;
+    }
+}
+
+#ifdef MEME_FX_X86
+// Eight hashes at once; bytes are scaled in 16-bit lanes, the in-lane
+// unpack and pack undo each other so the byte order is unchanged.
+__attribute__((target ("avx2")))
+static void noise_fill_avx2 (gint8 *scratch, int width, guint32 key, const int *src_x, int amplitude) {
+    const __m256i vkey = _mm256_set1_epi32 ((int) key);
+    const __m256i c1 = _mm256_set1_epi32 ((int) 0x85EBCA6Bu), c2 = _mm256_set1_epi32 ((int) 0xC2B2AE35u);
+    const __m256i span = _mm256_set1_epi16 ((short) (amplitude * 2 + 1));
+    const __m256i amp = _mm256_set1_epi16 ((short) amplitude);
+    const __m256i rgb_mask = _mm256_set1_epi32 (0x00ffffff);
+    const __m256i zero = _mm256_setzero_si256 ();
+    int x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        __m256i h = _mm256_add_epi32 (vkey, _mm256_loadu_si256 ((const __m256i *) (src_x + x)));
+        __m256i lo, hi;
+
+        h = _mm256_xor_si256 (h, _mm256_srli_epi32 (h, 16));
+        h = _mm256_mullo_epi32 (h, c1);
+        h = _mm256_xor_si256 (h, _mm256_srli_epi32 (h, 13));
+        h = _mm256_mullo_epi32 (h, c2);
+        h = _mm256_xor_si256 (h, _mm256_srli_epi32 (h, 16));
+
+        lo = _mm256_sub_epi16 (_mm256_srli_epi16 (_mm256_mullo_epi16 (_mm256_unpacklo_epi8 (h, zero), span), 8), amp);
+        hi = _mm256_sub_epi16 (_mm256_srli_epi16 (_mm256_mullo_epi16 (_mm256_unpackhi_epi8 (h, zero), span), 8), amp);
+        _mm256_storeu_si256 ((__m256i *) (scratch + x * 4),
+                             _mm256_and_si256 (_mm256_packs_epi16 (lo, hi), rgb_mask));
+    }
+    noise_fill_scalar (scratch + x * 4, width - x, key, src_x + x, amplitude);
+}
+#endif
+
+// Hashes the row's source pixels into signed RGB offsets in `scratch`
+// (width * 4 bytes, alpha offset 0), then adds them to the row.
+static void noise_row (guchar *row, int width, int n_channels, MemeFxIsa isa, int amplitude,
+                       guint32 seed, int src_y, const int *src_x, gint8 *scratch) {
+    guint32 key = noise_row_key (seed, src_y);
+
+#ifdef MEME_FX_X86
+    if (isa == MEME_FX_ISA_AVX2)
+        noise_fill_avx2 (scratch, width, key, src_x, amplitude);
+    else
+        noise_fill_scalar (scratch, width, key, src_x, amplitude);
+
+    if (isa != MEME_FX_ISA_SCALAR) {
+        noise_add_sse2 (row, width, scratch);
+        return;
+    }
+#else
+    noise_fill_scalar (scratch, width, key, src_x, amplitude);
+#endif
+    noise_add_scalar (row, width, n_channels, scratch);
+}
+
+// Same result as a point-filter downscale by `block` followed by a point
+// upscale, but in place.
+void meme_fx_pixelate (guchar *pixels, int width, int height, int rowstride, int n_channels, int block) {
+    MemeFxChain chain;
+
+    meme_fx_chain_init (&chain);
+    meme_fx_chain_pixelate (&chain, block);
+    meme_fx_chain_run (&chain, pixels, width, height, rowstride, n_channels, 1.0);
+}
+
+void meme_fx_noise (guchar *pixels, int width, int height, int rowstride, int n_channels,
+                    int amplitude, guint32 seed) {
+    MemeFxChain chain;
+
+    meme_fx_chain_init (&chain);
+    meme_fx_chain_noise (&chain, amplitude, seed);
+    meme_fx_chain_run (&chain, pixels, width, height, rowstride, n_channels, 1.0);
+}
+
+static void lut_row (guchar *row, int width, int n_channels, const guchar *lut) {
+    int x;
+
+    for (x = 0; x < width; x++) {
+        guchar *p = row + x * n_channels;
+        p[0] = lut[p[0]];
+        p[1] = lut[p[1]];
+        p[2] = lut[p[2]];
+    }
+}
+
+void meme_fx_chain_init (MemeFxChain *chain) {
+    int i;
+
+    memset (chain, 0, sizeof *chain);
+    for (i = 0; i < 3; i++) chain->matrix.m[i][i] = 1.0f;
+    for (i = 0; i < 256; i++) chain->lut[i] = (guchar) i;
+}
+
+// Applies `op` after whatever the matrix already does: M = op * M.
+static void chain_mix (MemeFxChain *chain, const float op[3][3]) {
+    MemeFxMatrix prev = chain->matrix;
+    int i, j;
+
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++)
+            chain->matrix.m[i][j] = op[i][0] * prev.m[0][j] + op[i][1] * prev.m[1][j] + op[i][2] * prev.m[2][j];
+        chain->matrix.offset[i] = op[i][0] * prev.offset[0] + op[i][1] * prev.offset[1] + op[i][2] * prev.offset[2];
+    }
+    chain->has_matrix = TRUE;
+}
+
+void meme_fx_chain_grayscale (MemeFxChain *chain) {
+    meme_fx_chain_saturation (chain, 0.0);
+}
+
+void meme_fx_chain_saturation (MemeFxChain *chain, double sat) {
+    const float luma[3] = { LUMA_R, LUMA_G, LUMA_B };
+    float op[3][3];
+    int i, j;
+
+    for (i = 0; i < 3; i++)
+        for (j = 0; j < 3; j++)
+            op[i][j] = (float) ((1.0 - sat) * luma[j] + (i == j ? sat : 0.0));
+    chain_mix (chain, op);
+}
+
+// Contrast curves compose inside the LUT, so the clamp between two of
+// them is kept exactly as if they ran one after the other.
+void meme_fx_chain_contrast (MemeFxChain *chain, double contrast) {
+    int i;
+
+    for (i = 0; i < 256; i++)
+        chain->lut[i] = clamp_round ((float) (contrast * (chain->lut[i] - 128.0) + 128.0));
+    chain->has_lut = TRUE;
+}
+
+void meme_fx_chain_pixelate (MemeFxChain *chain, int block) {
+    chain->block = MAX (chain->block, block);
+}
+
+void meme_fx_chain_noise (MemeFxChain *chain, int amplitude, guint32 seed) {
+    chain->noise = CLAMP (amplitude, 0, 127);
+    chain->seed = seed;
+}
+
+gboolean meme_fx_chain_is_identity (const MemeFxChain *chain) {
+    return chain->block <= 1 && chain->noise <= 0 && !chain->has_matrix && !chain->has_lut;
+}
+
+void meme_fx_chain_run (const MemeFxChain *chain, guchar *pixels, int width, int height,
+                        int rowstride, int n_channels, double scale) {
+    MemeFxIsa isa = (n_channels == 4) ? meme_fx_get_isa () : MEME_FX_ISA_SCALAR;
+    int *src_x, *src_y, *mid_x = NULL;
+    gint8 *scratch = NULL;
+    int by, y;
+
+    if (width <= 0 || height <= 0) return;
+
+    src_x = source_coords (width, scale);
+    src_y = source_coords (height, scale);
+    if (chain->block > 1)
+        mid_x = block_centres (src_x, width, chain->block);
+    if (chain->noise > 0)
+        scratch = g_malloc ((gsize) width * 4);
+
+    for (by = 0; by < height; ) {
+        // one block row when pixelating, otherwise 16 rows stay well inside L2
+        int bh = 1;
+        guchar *band_start = pixels + (gsize) by * rowstride;
+
+        if (chain->block > 1) {
+            while (by + bh < height && src_y[by + bh] / chain->block == src_y[by] / chain->block) bh++;
+            pixelate_band (band_start, width, bh, rowstride, n_channels, mid_x);
+        } else {
+            bh = MIN (16, height - by);
+        }
+
+        for (y = 0; y < bh; y++) {
+            guchar *row = band_start + (gsize) y * rowstride;
+
+            if (chain->noise > 0)
+                noise_row (row, width, n_channels, isa, chain->noise, chain->seed, src_y[by + y], src_x, scratch);
+            if (chain->has_matrix)
+                color_matrix_row (row, width, n_channels, isa, &chain->matrix);
+            if (chain->has_lut)
+                lut_row (row, width, n_channels, chain->lut);
+        }
+        by += bh;
+    }
+
+    g_free (src_x);
+    g_free (src_y);
+    g_free (mid_x);
+    g_free (scratch);
+}
@@ -5,23 +5,24 @@
 #include <gio/gio.h>
 #include <MagickWand/MagickWand.h>
 
+// Pixel memory ImageMagick may hold while a GIF is assembled; frames past
+// it go to its disk cache, so long animations export in bounded RAM.
+#define GIF_EXPORT_MEMORY_LIMIT (256 * 1024 * 1024)
+
 typedef struct {
     GFile *dest_file;
-    char *source_path;
-    GList *layers_copy;
-    gboolean cinematic;
-    gboolean deepfry;
-    gboolean bw;
+    MemeGifFrames *frames;
+    MemeScene *scene;
+    GArray *template_ops;
 } GifExportData;
 // async gif handling functions, fucking hell why is it so hard to do async
 // work
 static void gif_export_data_free(gpointer data) {
     GifExportData *ctx = (GifExportData *)data;
     g_clear_object(&ctx->dest_file);
-    g_free(ctx->source_path);
-    if (ctx->layers_copy) {
-        meme_layer_list_free(ctx->layers_copy);
-    }
+    g_clear_pointer(&ctx->frames, meme_gif_frames_unref);
+    g_clear_pointer(&ctx->scene, meme_scene_unref);
+    g_clear_pointer(&ctx->template_ops, g_array_unref);
     g_free(ctx);
 }
 
@@ -40,15 +41,14 @@ meme_window_open_file (MemeWindow *self, GFile *file)
         self->template_is_gif = FALSE;
     }
 
-    self->template_image = gdk_pixbuf_new_from_file (path, NULL);
+    meme_window_set_template_image (self, gdk_pixbuf_new_from_file (path, NULL));
 
     if (self->layers) {
-        meme_layer_list_free (self->layers);
-        self->layers = NULL;
+        meme_window_end_drag_session (self);
+        meme_layer_store_clear (self->layers);
         self->selected_layer = NULL;
     }
-    free_history_stack (&self->undo_stack);
-    free_history_stack (&self->redo_stack);
+    meme_window_clear_history (self);
 
     if (self->template_image) {
         gtk_stack_set_visible_child_name (self->content_stack, "content");
@@ -74,95 +74,16 @@ meme_window_open_file (MemeWindow *self, GFile *file)
     g_free (path);
 }
 
-static GdkPixbuf *
-magick_frame_to_pixbuf(MagickWand *wand)
-{
-    gsize w, h;
-    gboolean has_alpha;
-    guchar *buf;
-    MagickBooleanType ok;
-
-    w = MagickGetImageWidth(wand);
-    h = MagickGetImageHeight(wand);
-    has_alpha = MagickGetImageAlphaChannel(wand);
-
-    buf = g_malloc(w * h * (has_alpha ? 4 : 3));
-    ok = MagickExportImagePixels(wand, 0, 0, w, h,
-                                  has_alpha ? "RGBA" : "RGB",
-                                  CharPixel, buf);
-    if (ok != MagickTrue) {
-        g_free(buf);
-        return NULL;
-    }
-
-    return gdk_pixbuf_new_from_data(buf, GDK_COLORSPACE_RGB, has_alpha, 8,
-                                     w, h, w * (has_alpha ? 4 : 3),
-                                     (GdkPixbufDestroyNotify) g_free, NULL);
-}
-
-
-GArray *
-meme_gif_decode_frames (const char *path) {
-    MagickWand *source_wand, *coalesced;
-    GArray *frames;
-    int frame_count = 0;
-
-    MagickWandGenesis ();
-    source_wand = NewMagickWand ();
-    if (MagickReadImage (source_wand, path) != MagickTrue) {
-        DestroyMagickWand (source_wand);
-        MagickWandTerminus ();
-        return NULL;
-    }
-    coalesced = MagickCoalesceImages (source_wand);
-    DestroyMagickWand (source_wand);
-
-    frames = g_array_new (FALSE, FALSE, sizeof (GifFrame));
-
-    MagickResetIterator (coalesced);
-    while (MagickNextImage (coalesced) != MagickFalse && frame_count < 200) {
-        GdkPixbuf *pix = magick_frame_to_pixbuf (coalesced);
-        GifFrame gf;
-
-        if (!pix)
-            continue;
-
-        gf.pixbuf = pix;
-        gf.delay_ms = MAX ((int) MagickGetImageDelay (coalesced) * 10, 20);
-        g_array_append_val (frames, gf);
-        frame_count++;
-    }
-    DestroyMagickWand (coalesced);
-    MagickWandTerminus ();
-
-    if (frames->len == 0) {
-        g_array_free (frames, TRUE);
-        return NULL;
-    }
-    return frames;
-}
-
-void
-meme_gif_frames_free (GArray *frames) {
-    guint i;
-
-    if (!frames)
-        return;
-
-    for (i = 0; i < frames->len; i++) {
-        GifFrame *f = &g_array_index (frames, GifFrame, i);
-        g_clear_object (&f->pixbuf);
-    }
-    g_array_free (frames, TRUE);
-}
+// How often to look again when the decoder hasn't caught up.
+#define GIF_POLL_MS 10
 
 static gboolean
 on_gif_preview_tick (gpointer user_data) {
     MemeWindow *self = MEME_WINDOW (user_data);
-    GifFrame *frame;
-    GdkPixbuf *copy;
+    GdkPixbuf *frame;
 
-    if (!self->gif_frames || self->gif_frames->len == 0) {
+    if (!self->gif_stream || meme_gif_stream_get_n_frames (self->gif_stream) == 0 ||
+        meme_gif_stream_get_n_frames (self->gif_stream) == 1) {
         self->gif_timeout_id = 0;
         return G_SOURCE_REMOVE;
     }
@@ -172,16 +93,15 @@ on_gif_preview_tick (gpointer user_data) {
         return G_SOURCE_REMOVE;
     }
 
-    self->gif_frame_index = (self->gif_frame_index + 1) % self->gif_frames->len;
-    frame = &g_array_index (self->gif_frames, GifFrame, self->gif_frame_index);
-
-
-    copy = gdk_pixbuf_copy (frame->pixbuf);
-    g_clear_object (&self->template_image);
-    self->template_image = copy;
+    frame = meme_gif_stream_pop (self->gif_stream, FALSE, &self->gif_delay_ms);
+    if (!frame) {
+        self->gif_timeout_id = g_timeout_add (GIF_POLL_MS, on_gif_preview_tick, self);
+        return G_SOURCE_REMOVE;
+    }
+    meme_window_set_template_image (self, frame);
     render_meme (self);
 
-    self->gif_timeout_id = g_timeout_add (frame->delay_ms, on_gif_preview_tick, self);
+    self->gif_timeout_id = g_timeout_add (self->gif_delay_ms, on_gif_preview_tick, self);
     return G_SOURCE_REMOVE;
 }
 
@@ -195,67 +115,10 @@ meme_window_pause_gif_animation (MemeWindow *self) {
 
 void
 meme_window_resume_gif_animation (MemeWindow *self) {
-    GifFrame *frame;
-
-    if (self->gif_timeout_id || !self->gif_frames || self->gif_frames->len == 0)
+    if (self->gif_timeout_id || !self->gif_stream)
         return;
 
-    frame = &g_array_index (self->gif_frames, GifFrame, self->gif_frame_index);
-    self->gif_timeout_id = g_timeout_add (frame->delay_ms, on_gif_preview_tick, self);
-}
-
-void
-meme_window_transform_gif_frames_rotate (MemeWindow *self, gboolean clockwise) {
-    guint i;
-
-    if (!self->gif_frames)
-        return;
-
-    for (i = 0; i < self->gif_frames->len; i++) {
-        GifFrame *f = &g_array_index (self->gif_frames, GifFrame, i);
-        GdkPixbuf *rotated = gdk_pixbuf_rotate_simple (f->pixbuf,
-            clockwise ? GDK_PIXBUF_ROTATE_CLOCKWISE : GDK_PIXBUF_ROTATE_COUNTERCLOCKWISE);
-        g_object_unref (f->pixbuf);
-        f->pixbuf = rotated;
-    }
-}
-
-void
-meme_window_transform_gif_frames_flip (MemeWindow *self, gboolean horizontal) {
-    guint i;
-
-    if (!self->gif_frames)
-        return;
-
-    for (i = 0; i < self->gif_frames->len; i++) {
-        GifFrame *f = &g_array_index (self->gif_frames, GifFrame, i);
-        GdkPixbuf *flipped = gdk_pixbuf_flip (f->pixbuf, horizontal);
-        g_object_unref (f->pixbuf);
-        f->pixbuf = flipped;
-    }
-}
-
-void
-meme_window_transform_gif_frames_crop (MemeWindow *self, int x, int y, int w, int h) {
-    guint i;
-
-    if (!self->gif_frames)
-        return;
-
-    for (i = 0; i < self->gif_frames->len; i++) {
-        GifFrame *f = &g_array_index (self->gif_frames, GifFrame, i);
-        int fw = gdk_pixbuf_get_width (f->pixbuf);
-        int fh = gdk_pixbuf_get_height (f->pixbuf);
-        int cx = CLAMP (x, 0, fw - 1);
-        int cy = CLAMP (y, 0, fh - 1);
-        int cw = CLAMP (w, 1, fw - cx);
-        int ch = CLAMP (h, 1, fh - cy);
-        GdkPixbuf *sub = gdk_pixbuf_new_subpixbuf (f->pixbuf, cx, cy, cw, ch);
-        GdkPixbuf *copy = gdk_pixbuf_copy (sub);
-        g_object_unref (sub);
-        g_object_unref (f->pixbuf);
-        f->pixbuf = copy;
-    }
+    self->gif_timeout_id = g_timeout_add (self->gif_delay_ms, on_gif_preview_tick, self);
 }
 
 void
@@ -264,61 +127,56 @@ meme_window_stop_gif_animation (MemeWindow *self) {
         g_source_remove (self->gif_timeout_id);
         self->gif_timeout_id = 0;
     }
-    if (self->gif_frames) {
-        meme_gif_frames_free (self->gif_frames);
-        self->gif_frames = NULL;
-    }
+    g_clear_pointer (&self->gif_stream, meme_gif_stream_free);
+    g_clear_pointer (&self->gif_frames, meme_gif_frames_unref);
 }
 
+// Frame 0 is already on screen as the template; the rest streams in.
 void meme_window_start_gif_animation (MemeWindow *self) {
-    GifFrame *first;
-
     meme_window_stop_gif_animation (self);
 
     if (!self->template_is_gif || !self->template_gif_path)
         return;
 
-    self->gif_frames = meme_gif_decode_frames (self->template_gif_path);
-    if (!self->gif_frames || self->gif_frames->len <= 1)
-        return;
-
-    self->gif_frame_index = 0;
-    first = &g_array_index (self->gif_frames, GifFrame, 0);
-    self->gif_timeout_id = g_timeout_add (first->delay_ms, on_gif_preview_tick, self);
+    self->gif_frames = meme_gif_frames_new (self->template_gif_path);
+    self->gif_stream = meme_gif_stream_new (self->gif_frames, self->template_ops);
+    // frame 0 comes round again from the stream, with its delay
+    self->gif_delay_ms = GIF_POLL_MS;
+    self->gif_timeout_id = g_timeout_add (self->gif_delay_ms, on_gif_preview_tick, self);
 }
 
 static void export_gif_thread(GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable) {
     MagickWand *optimized, *wand;
-    MagickWand *source_wand, *coalesced;
     char *dest_path;
     int frame_count;
+    MemeRenderCache *cache;
 
     GifExportData *ctx = (GifExportData *)task_data;
 
     MagickWandGenesis();
-    source_wand = NewMagickWand();
-    MagickReadImage(source_wand, ctx->source_path);
-    coalesced = MagickCoalesceImages(source_wand);
-    DestroyMagickWand(source_wand);
-
+    MagickSetResourceLimit(MemoryResource, GIF_EXPORT_MEMORY_LIMIT);
+    MagickSetResourceLimit(MapResource, GIF_EXPORT_MEMORY_LIMIT);
     wand = NewMagickWand();
     frame_count = 0;
+    cache = meme_render_cache_new();
 
-    MagickResetIterator(coalesced);
-    while (MagickNextImage(coalesced) != MagickFalse && frame_count < 200) {
+    // the frames the preview plays, pulled one at a time, rotated/flipped/cropped on the way
+    while (!g_cancellable_is_cancelled(cancellable)) {
         int delay_ms, w, h, channels;
         GdkPixbuf *comp;
         const guchar *pixels;
         MagickWand *frame_wand;
         GdkPixbuf *frame;
+        MemeScene *frame_scene;
 
-        frame = magick_frame_to_pixbuf(coalesced);
+        frame = meme_gif_frames_get(ctx->frames, frame_count, ctx->template_ops, &delay_ms);
         if (!frame) {
-            continue;
+            break;
         }
 
-        delay_ms = MAX((int)MagickGetImageDelay(coalesced) * 10, 10);
-        comp = meme_render_composite(frame, ctx->layers_copy, ctx->cinematic, ctx->deepfry, ctx->bw, FALSE);
+        frame_scene = meme_scene_new_for_background(ctx->scene, frame, frame_count + 1);
+        comp = meme_render_scene(frame_scene, cache, FALSE, NULL);
+        meme_scene_unref(frame_scene);
         w = gdk_pixbuf_get_width(comp);
         h = gdk_pixbuf_get_height(comp);
         channels = gdk_pixbuf_get_n_channels(comp);
@@ -326,6 +184,8 @@ static void export_gif_thread(GTask *task, gpointer source_object, gpointer task
 
         frame_wand = NewMagickWand();
         MagickConstituteImage(frame_wand, w, h, channels == 4 ? "RGBA" : "RGB", CharPixel, pixels);
+        // GIF keeps 256 colours per frame anyway, reduce now rather than over the whole sequence
+        MagickQuantizeImage(frame_wand, 256, sRGBColorspace, 0, NoDitherMethod, MagickFalse);
 
         MagickSetImageDelay(frame_wand, delay_ms / 10);
 
@@ -336,7 +196,13 @@ static void export_gif_thread(GTask *task, gpointer source_object, gpointer task
 
         frame_count++;
     }
-    DestroyMagickWand(coalesced);
+    meme_render_cache_free(cache);
+
+    if (g_task_return_error_if_cancelled(task)) {
+        DestroyMagickWand(wand);
+        MagickWandTerminus();
+        return;
+    }
 
     optimized = MagickOptimizeImageLayers(wand);
     dest_path = g_file_get_path(ctx->dest_file);
@@ -350,15 +216,26 @@ static void export_gif_thread(GTask *task, gpointer source_object, gpointer task
     g_task_return_boolean(task, TRUE);
 }
 
+void on_export_cancel_clicked(MemeWindow *self) {
+    if (self->export_cancellable)
+        g_cancellable_cancel(self->export_cancellable);
+}
+
 static void on_gif_export_ready(GObject *source_object, GAsyncResult *res, gpointer user_data) {
     MemeWindow *self = MEME_WINDOW(user_data);
     GError *error = NULL;
 
     gtk_widget_set_visible(GTK_WIDGET(self->export_loading_screen), FALSE);
+    g_clear_object(&self->export_cancellable);
+    if (!gtk_toggle_button_get_active(self->crop_mode_button))
+        meme_window_resume_gif_animation(self);
 
     if (g_task_propagate_boolean(G_TASK(res), &error)) {
         AdwToast *toast = adw_toast_new("GIF exported successfully!");
         adw_toast_overlay_add_toast(self->copy_clip_feedback, toast);
+    } else if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        adw_toast_overlay_add_toast(self->copy_clip_feedback, adw_toast_new("GIF export cancelled"));
+        g_error_free(error);
     } else {
         char *err_msg = g_strdup_printf("Failed to export GIF: %s", error->message);
         AdwToast *toast = adw_toast_new(err_msg);
@@ -455,8 +332,8 @@ static void on_save_project_response (GObject *s, GAsyncResult *r, gpointer d) {
 
     // Count async encodes needed upfront
     encode_count = (self->template_image != NULL) ? 1 : 0;
-    for (GList *l = self->layers; l != NULL; l = l->next) {
-        ImageLayer *layer = l->data;
+    for (guint j = 0; j < meme_layer_store_len (self->layers); j++) {
+        ImageLayer *layer = meme_layer_store_get (self->layers, j);
         if (layer->type == LAYER_TYPE_IMAGE && layer->pixbuf)
             encode_count++;
     }
@@ -468,10 +345,10 @@ static void on_save_project_response (GObject *s, GAsyncResult *r, gpointer d) {
 
     g_key_file_set_boolean (keyfile, "Project", "deep_fry",  gtk_toggle_button_get_active (self->deep_fry_button));
     g_key_file_set_boolean (keyfile, "Project", "cinematic", gtk_toggle_button_get_active (self->cinematic_button));
+    g_key_file_set_uint64  (keyfile, "Project", "seed",      self->fx_seed);
 
-    i = 0;
-    for (GList *l = self->layers; l != NULL; l = l->next, i++) {
-        ImageLayer *layer = l->data;
+    for (i = 0; i < (int) meme_layer_store_len (self->layers); i++) {
+        ImageLayer *layer = meme_layer_store_get (self->layers, i);
         gchar group[32];
         g_snprintf (group, sizeof (group), "Layer%d", i);
 
@@ -486,6 +363,9 @@ static void on_save_project_response (GObject *s, GAsyncResult *r, gpointer d) {
         if (layer->type == LAYER_TYPE_TEXT && layer->text) {
             g_key_file_set_string (keyfile, group, "text",      layer->text);
             g_key_file_set_double (keyfile, group, "font_size", layer->font_size);
+            g_key_file_set_double (keyfile, group, "wrap_width", layer->wrap_width);
+            g_key_file_set_boolean (keyfile, group, "auto_fit", layer->auto_fit);
+            g_key_file_set_integer (keyfile, group, "fit_lines", layer->fit_lines);
         } else if (layer->type == LAYER_TYPE_IMAGE && layer->pixbuf) {
             EncodeCtx *ctx  = g_new0 (EncodeCtx, 1);
             ctx->save_ctx   = save_ctx;
@@ -543,16 +423,18 @@ static void on_project_load_contents_finished(GObject *source_object, GAsyncResu
 
             on_clear_clicked(self);
             b64_template = g_key_file_get_string(keyfile, "Project", "template", NULL);
-            if(b64_template){ self->template_image = base64_to_pixbuf(b64_template); g_free(b64_template); }
+            if(b64_template){ meme_window_set_template_image(self, base64_to_pixbuf(b64_template)); g_free(b64_template); }
 
+            // older projects have no seed and keep the fresh one from on_clear_clicked()
+            if(g_key_file_has_key(keyfile, "Project", "seed", NULL))
+                self->fx_seed = (guint32)g_key_file_get_uint64(keyfile, "Project", "seed", NULL);
             gtk_toggle_button_set_active(self->deep_fry_button, g_key_file_get_boolean(keyfile, "Project", "deep_fry", NULL));
             gtk_toggle_button_set_active(self->cinematic_button, g_key_file_get_boolean(keyfile, "Project", "cinematic", NULL));
             count = g_key_file_get_integer(keyfile, "Project", "layer_count", NULL);
             for(int i = 0; i < count; i++){
                 ImageLayer *layer;
                 gchar group[32]; g_snprintf(group, sizeof(group), "Layer%d", i);
-                layer = g_new0(ImageLayer, 1);
-                layer->type = g_key_file_get_integer(keyfile, group, "type", NULL);
+                layer = meme_layer_new(g_key_file_get_integer(keyfile, group, "type", NULL));
                 layer->x = g_key_file_get_double(keyfile, group, "x", NULL);
                 layer->y = g_key_file_get_double(keyfile, group, "y", NULL);
                 layer->scale = g_key_file_get_double(keyfile, group, "scale", NULL);
@@ -563,6 +445,11 @@ static void on_project_load_contents_finished(GObject *source_object, GAsyncResu
                 if(layer->type == LAYER_TYPE_TEXT){
                     layer->text = g_key_file_get_string(keyfile,group, "text", NULL);
                     layer->font_size = g_key_file_get_double(keyfile, group, "font_size", NULL);
+                    if (g_key_file_has_key(keyfile, group, "wrap_width", NULL))
+                        layer->wrap_width = CLAMP(g_key_file_get_double(keyfile, group, "wrap_width", NULL), 0.1, 1.0);
+                    layer->auto_fit = g_key_file_get_boolean(keyfile, group, "auto_fit", NULL);
+                    if (g_key_file_has_key(keyfile, group, "fit_lines", NULL))
+                        layer->fit_lines = g_key_file_get_integer(keyfile, group, "fit_lines", NULL);
                 }else if(layer->type == LAYER_TYPE_IMAGE){
                     gchar *b64 = g_key_file_get_string(keyfile, group, "pixbuf", NULL);
                     if(b64){
@@ -572,7 +459,7 @@ static void on_project_load_contents_finished(GObject *source_object, GAsyncResu
                         g_free(b64);
                     }
                 }
-                self->layers = g_list_append(self->layers, layer);
+                meme_layer_store_append(self->layers, layer);
             }
             if(self->template_image){
                 gtk_stack_set_visible_child_name(self->content_stack, "content");
@@ -640,14 +527,14 @@ static void on_add_image_response(GObject *s, GAsyncResult *r, gpointer d) {
     GFile *file = gtk_file_dialog_open_finish(dialog, r, NULL);
     if (file) {
         char *path = g_file_get_path(file);
-        ImageLayer *new_layer = g_new0(ImageLayer, 1);
+        ImageLayer *new_layer = meme_layer_new(LAYER_TYPE_IMAGE);
         new_layer->pixbuf = gdk_pixbuf_new_from_file(path, NULL);
         if (new_layer->pixbuf) {
             push_undo(self);
             new_layer->width = gdk_pixbuf_get_width(new_layer->pixbuf);
             new_layer->height = gdk_pixbuf_get_height(new_layer->pixbuf);
             new_layer->x=0.5; new_layer->y=0.5; new_layer->scale=1.0; new_layer->opacity=1.0;
-            self->layers = g_list_append(self->layers, new_layer);
+            meme_layer_store_append(self->layers, new_layer);
             self->selected_layer = new_layer;
             sync_ui_with_layer(self); render_meme(self);
         }
@@ -696,13 +583,15 @@ static void on_export_file_response(GObject *s, GAsyncResult *r, gpointer d) {
         adw_toast_overlay_add_toast(self->copy_clip_feedback, starting_toast);
 
         data->dest_file = g_object_ref(file);
-        data->source_path = g_strdup(self->template_gif_path);
-        data->layers_copy = meme_layer_list_copy(self->layers);
-        data->cinematic = gtk_toggle_button_get_active(self->cinematic_button);
-        data->deepfry = gtk_toggle_button_get_active(self->deep_fry_button);
-        data->bw = gtk_toggle_button_get_active(self->bw_button);
-
-        task = g_task_new(self, NULL, on_gif_export_ready, self);
+        data->frames = self->gif_frames ? meme_gif_frames_ref(self->gif_frames)
+                                        : meme_gif_frames_new(self->template_gif_path);
+        // playback would pull the shared decoder back and forth under the export
+        meme_window_pause_gif_animation(self);
+        data->scene = meme_window_build_scene(self);
+        data->template_ops = g_array_copy(self->template_ops);
+
+        self->export_cancellable = g_cancellable_new();
+        task = g_task_new(self, self->export_cancellable, on_gif_export_ready, self);
         g_task_set_task_data(task, data, gif_export_data_free);
 
         g_task_run_in_thread(task, export_gif_thread);
@@ -712,17 +601,12 @@ static void on_export_file_response(GObject *s, GAsyncResult *r, gpointer d) {
         return;
     }
 
+    meme_window_flush_render(self);
     if (self->final_meme) {
         GError *error;
         GFileOutputStream *stream;
 
-        GdkPixbuf *save = self->final_meme;
-        if (gtk_toggle_button_get_active(self->crop_mode_button)) {
-            int iw = gdk_pixbuf_get_width(save); int ih = gdk_pixbuf_get_height(save);
-            save = gdk_pixbuf_new_subpixbuf(save, self->crop_x*iw, self->crop_y*ih, self->crop_w*iw, self->crop_h*ih);
-        } else {
-            g_object_ref(save);
-        }
+        GdkPixbuf *save = meme_scene_crop_output(self->scene, self->final_meme);
 
         // Remove alpha channel for JPEGs
         if (g_strcmp0(format, "jpeg") == 0 && gdk_pixbuf_get_has_alpha(save)) {
@@ -797,6 +681,7 @@ void on_export_clicked(MemeWindow *self) {
     GtkStringList *model;
     static const char *format_labels[] = { "PNG", "JPG", "WebP", "GIF", NULL };
 
+    meme_window_flush_render(self);
     if (!self->final_meme) return;
 
     model = gtk_string_list_new(format_labels);
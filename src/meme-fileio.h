@@ -4,6 +4,7 @@
 void on_load_image_clicked (MemeWindow *self);
 void on_add_image_clicked (MemeWindow *self);
 void on_export_clicked (MemeWindow *self);
+void on_export_cancel_clicked (MemeWindow *self);
 void on_load_project_clicked (MemeWindow *self);
 
 typedef struct {
@@ -0,0 +1,223 @@
+/* meme-gif-frames.c
+ *
+ * Copyright 2025 Giovanni
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#include "meme-gif-frames.h"
+#include <string.h>
+
+// Decoded frames kept for whoever asks next.
+#define CACHE_FRAMES 8
+// Used for frames that would otherwise stay up forever.
+#define DEFAULT_DELAY_MS 100
+
+typedef struct {
+    guint index;
+    GArray *ops;
+    GdkPixbuf *pixbuf;
+    int delay_ms;
+} CachedFrame;
+
+struct _MemeGifFrames {
+    gint ref_count;
+    char *path;
+    GMutex lock;
+
+    // all below under `lock`
+    gboolean loaded;
+    int n_frames;
+    GdkPixbufAnimation *anim;
+    GdkPixbufAnimationIter *iter;
+    G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+    GTimeVal t;              // time fed to `iter`
+    G_GNUC_END_IGNORE_DEPRECATIONS
+    guint at;                // frame `iter` is on
+    GQueue cache;            // CachedFrame, most recently used first
+};
+
+static void cached_frame_free (gpointer data) {
+    CachedFrame *cached = data;
+
+    g_array_unref (cached->ops);
+    g_object_unref (cached->pixbuf);
+    g_free (cached);
+}
+
+static gboolean ops_equal (const GArray *a, const GArray *b) {
+    guint la = a ? a->len : 0, lb = b ? b->len : 0;
+
+    return la == lb && (!la || memcmp (a->data, b->data, la * sizeof (MemeTemplateOp)) == 0);
+}
+
+/* Counts image descriptors by walking the block structure, skipping the
+ * compressed data, so it costs no decoding. */
+static int count_frames (const guint8 *data, gsize len) {
+    gsize pos = 13;
+    int n = 0;
+
+    if (len < 13 || memcmp (data, "GIF", 3) != 0) return 0;
+    if (data[10] & 0x80) pos += 3 << ((data[10] & 7) + 1);
+
+    while (pos < len) {
+        guint8 block = data[pos++];
+
+        if (block == 0x2c) {
+            if (pos + 9 > len) break;
+            if (data[pos + 8] & 0x80) pos += 3 << ((data[pos + 8] & 7) + 1);
+            pos += 9 + 1;    // descriptor, colour table, LZW code size
+            n++;
+        } else if (block == 0x21) {
+            pos++;           // extension label
+        } else {
+            break;           // trailer or garbage
+        }
+        while (pos < len && data[pos]) pos += data[pos] + 1;
+        pos++;
+    }
+    return n;
+}
+
+static int load_locked (MemeGifFrames *frames) {
+    GInputStream *input;
+    char *contents;
+    gsize len;
+
+    if (frames->loaded) return frames->n_frames;
+    frames->loaded = TRUE;
+
+    if (!g_file_get_contents (frames->path, &contents, &len, NULL)) return frames->n_frames = 0;
+    frames->n_frames = count_frames ((const guint8 *) contents, len);
+    input = g_memory_input_stream_new_from_data (contents, len, g_free);
+    frames->anim = gdk_pixbuf_animation_new_from_stream (input, NULL, NULL);
+    g_object_unref (input);
+    if (!frames->anim) frames->n_frames = 0;
+    return frames->n_frames;
+}
+
+/* Moves the decoder to frame `index`: forward along the timeline, or
+ * from the start of a fresh one (GIFs that play once stop on their last
+ * frame otherwise). Frames passed over aren't composited. */
+G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+static void seek_locked (MemeGifFrames *frames, guint index) {
+    if (!frames->iter || index < frames->at) {
+        g_clear_object (&frames->iter);
+        frames->t.tv_sec = 0;
+        frames->t.tv_usec = 0;
+        frames->iter = gdk_pixbuf_animation_get_iter (frames->anim, &frames->t);
+        frames->at = 0;
+    }
+    for (; frames->at < index; frames->at++) {
+        int delay = gdk_pixbuf_animation_iter_get_delay_time (frames->iter);
+
+        g_time_val_add (&frames->t, (delay > 0 ? delay : DEFAULT_DELAY_MS) * 1000);
+        gdk_pixbuf_animation_iter_advance (frames->iter, &frames->t);
+    }
+}
+G_GNUC_END_IGNORE_DEPRECATIONS
+
+MemeGifFrames *meme_gif_frames_new (const char *path) {
+    MemeGifFrames *frames = g_new0 (MemeGifFrames, 1);
+
+    frames->ref_count = 1;
+    frames->path = g_strdup (path);
+    frames->n_frames = -1;
+    g_mutex_init (&frames->lock);
+    g_queue_init (&frames->cache);
+    return frames;
+}
+
+MemeGifFrames *meme_gif_frames_ref (MemeGifFrames *frames) {
+    g_atomic_int_inc (&frames->ref_count);
+    return frames;
+}
+
+void meme_gif_frames_unref (MemeGifFrames *frames) {
+    if (!frames || !g_atomic_int_dec_and_test (&frames->ref_count)) return;
+
+    g_queue_clear_full (&frames->cache, cached_frame_free);
+    g_clear_object (&frames->iter);
+    g_clear_object (&frames->anim);
+    g_mutex_clear (&frames->lock);
+    g_free (frames->path);
+    g_free (frames);
+}
+
+int meme_gif_frames_load (MemeGifFrames *frames) {
+    int n;
+
+    g_mutex_lock (&frames->lock);
+    n = load_locked (frames);
+    g_mutex_unlock (&frames->lock);
+    return n;
+}
+
+int meme_gif_frames_get_n_frames (MemeGifFrames *frames) {
+    int n;
+
+    g_mutex_lock (&frames->lock);
+    n = frames->loaded ? frames->n_frames : -1;
+    g_mutex_unlock (&frames->lock);
+    return n;
+}
+
+GdkPixbuf *meme_gif_frames_get (MemeGifFrames *frames, guint index, const GArray *ops, int *delay_ms) {
+    CachedFrame *cached;
+    GdkPixbuf *pixbuf;
+    int delay;
+
+    g_mutex_lock (&frames->lock);
+    if (load_locked (frames) <= (int) index) {
+        g_mutex_unlock (&frames->lock);
+        return NULL;
+    }
+    for (GList *l = frames->cache.head; l; l = l->next) {
+        cached = l->data;
+        if (cached->index == index && ops_equal (cached->ops, ops)) {
+            g_queue_unlink (&frames->cache, l);
+            g_queue_push_head_link (&frames->cache, l);
+            pixbuf = g_object_ref (cached->pixbuf);
+            if (delay_ms) *delay_ms = cached->delay_ms;
+            g_mutex_unlock (&frames->lock);
+            return pixbuf;
+        }
+    }
+
+    G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+    seek_locked (frames, index);
+    delay = gdk_pixbuf_animation_iter_get_delay_time (frames->iter);
+    if (delay <= 0) delay = DEFAULT_DELAY_MS;
+    pixbuf = gdk_pixbuf_copy (gdk_pixbuf_animation_iter_get_pixbuf (frames->iter));
+    G_GNUC_END_IGNORE_DEPRECATIONS
+    g_mutex_unlock (&frames->lock);
+
+    pixbuf = meme_template_ops_replay (pixbuf, ops);
+
+    cached = g_new (CachedFrame, 1);
+    cached->index = index;
+    cached->ops = g_array_new (FALSE, FALSE, sizeof (MemeTemplateOp));
+    if (ops) g_array_append_vals (cached->ops, ops->data, ops->len);
+    cached->pixbuf = g_object_ref (pixbuf);
+    cached->delay_ms = delay;
+    g_mutex_lock (&frames->lock);
+    g_queue_push_head (&frames->cache, cached);
+    while (frames->cache.length > CACHE_FRAMES)
+        cached_frame_free (g_queue_pop_tail (&frames->cache));
+    g_mutex_unlock (&frames->lock);
+
+    if (delay_ms) *delay_ms = delay;
+    return pixbuf;
+}
@@ -0,0 +1,43 @@
+/* meme-gif-frames.h
+ *
+ * Copyright 2025 Giovanni
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#pragma once
+#include "meme-core.h"
+
+/* The frames of a document's animated GIF, read and parsed once and
+ * shared by preview playback and export. The file stays compressed
+ * (gdk-pixbuf composites one frame at a time) and only the last few
+ * decoded frames are kept, keyed by frame and the template operations
+ * applied to them. Thread safe; loading happens on first use, so create
+ * it anywhere and read it from workers. */
+typedef struct _MemeGifFrames MemeGifFrames;
+
+MemeGifFrames *meme_gif_frames_new (const char *path);
+MemeGifFrames *meme_gif_frames_ref (MemeGifFrames *frames);
+void meme_gif_frames_unref (MemeGifFrames *frames);
+
+// Loads if needed and returns the number of frames, 0 if the file can't be read.
+int meme_gif_frames_load (MemeGifFrames *frames);
+// Same without loading: -1 until someone has.
+int meme_gif_frames_get_n_frames (MemeGifFrames *frames);
+
+/* Frame `index` with `ops` (MemeTemplateOp, may be NULL) applied, a new
+ * reference, and how long to show it; NULL past the end. Frames are
+ * cheapest to get in order. */
+GdkPixbuf *meme_gif_frames_get (MemeGifFrames *frames, guint index, const GArray *ops, int *delay_ms);
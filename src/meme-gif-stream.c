@@ -0,0 +1,183 @@
+/* meme-gif-stream.c
+ *
+ * Copyright 2025 Giovanni
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#include "meme-gif-stream.h"
+
+// Frames decoded ahead of the reader.
+#define RING_FRAMES 6
+
+typedef struct {
+    GdkPixbuf *pixbuf;
+    int delay_ms;
+    guint index;
+} StreamFrame;
+
+struct _MemeGifStream {
+    MemeGifFrames *frames;
+    GThread *thread;
+    GMutex lock;
+    GCond cond;
+
+    // all below under `lock`
+    GQueue ring;             // StreamFrame, oldest first
+    GArray *ops;             // MemeTemplateOp
+    guint serial;            // bumped when decoded frames go stale
+    guint position;          // index of the frame the reader gets next
+    guint shown;             // index of the frame the reader got last
+    int n_frames;
+    gboolean quit;
+    gboolean done;           // the worker has stopped
+};
+
+static void stream_frame_free (gpointer data) {
+    StreamFrame *frame = data;
+
+    g_object_unref (frame->pixbuf);
+    g_free (frame);
+}
+
+static gpointer stream_thread (gpointer data) {
+    MemeGifStream *stream = data;
+    GArray *ops = NULL;
+    guint serial = 0, index = 0;
+    int n = meme_gif_frames_load (stream->frames);
+
+    g_mutex_lock (&stream->lock);
+    stream->n_frames = n;
+    g_cond_broadcast (&stream->cond);
+    while (n > 0) {
+        StreamFrame *frame;
+        GdkPixbuf *pixbuf;
+        int delay;
+
+        while (!stream->quit && stream->serial == serial && stream->ring.length >= RING_FRAMES)
+            g_cond_wait (&stream->cond, &stream->lock);
+        if (stream->quit) break;
+        if (stream->serial != serial || !ops) {
+            serial = stream->serial;
+            g_clear_pointer (&ops, g_array_unref);
+            ops = g_array_copy (stream->ops);
+            index = stream->position;
+        }
+        g_mutex_unlock (&stream->lock);
+
+        pixbuf = meme_gif_frames_get (stream->frames, index, ops, &delay);
+
+        g_mutex_lock (&stream->lock);
+        if (!pixbuf) break;
+        if (stream->serial != serial) {
+            g_object_unref (pixbuf);
+            continue;
+        }
+        frame = g_new (StreamFrame, 1);
+        frame->pixbuf = pixbuf;
+        frame->delay_ms = delay;
+        frame->index = index;
+        g_queue_push_tail (&stream->ring, frame);
+        g_cond_broadcast (&stream->cond);
+        index = (index + 1) % n;
+    }
+    stream->done = TRUE;
+    g_cond_broadcast (&stream->cond);
+    g_mutex_unlock (&stream->lock);
+
+    g_clear_pointer (&ops, g_array_unref);
+    return NULL;
+}
+
+MemeGifStream *meme_gif_stream_new (MemeGifFrames *frames, const GArray *ops) {
+    MemeGifStream *stream = g_new0 (MemeGifStream, 1);
+
+    stream->frames = meme_gif_frames_ref (frames);
+    g_mutex_init (&stream->lock);
+    g_cond_init (&stream->cond);
+    g_queue_init (&stream->ring);
+    stream->ops = g_array_new (FALSE, FALSE, sizeof (MemeTemplateOp));
+    if (ops) g_array_append_vals (stream->ops, ops->data, ops->len);
+    stream->n_frames = -1;
+    stream->thread = g_thread_new ("gif-stream", stream_thread, stream);
+    return stream;
+}
+
+void meme_gif_stream_free (MemeGifStream *stream) {
+    if (!stream) return;
+
+    g_mutex_lock (&stream->lock);
+    stream->quit = TRUE;
+    g_cond_broadcast (&stream->cond);
+    g_mutex_unlock (&stream->lock);
+    g_thread_join (stream->thread);
+
+    g_queue_clear_full (&stream->ring, stream_frame_free);
+    g_array_unref (stream->ops);
+    g_mutex_clear (&stream->lock);
+    g_cond_clear (&stream->cond);
+    meme_gif_frames_unref (stream->frames);
+    g_free (stream);
+}
+
+int meme_gif_stream_get_n_frames (MemeGifStream *stream) {
+    int n;
+
+    g_mutex_lock (&stream->lock);
+    n = stream->n_frames;
+    g_mutex_unlock (&stream->lock);
+    return n;
+}
+
+GdkPixbuf *meme_gif_stream_pop (MemeGifStream *stream, gboolean wait, int *delay_ms) {
+    StreamFrame *frame;
+    GdkPixbuf *pixbuf = NULL;
+
+    g_mutex_lock (&stream->lock);
+    while (wait && !stream->done && !stream->ring.length)
+        g_cond_wait (&stream->cond, &stream->lock);
+    frame = g_queue_pop_head (&stream->ring);
+    if (frame) {
+        stream->position = (frame->index + 1) % stream->n_frames;
+        stream->shown = frame->index;
+        g_cond_broadcast (&stream->cond);
+    }
+    g_mutex_unlock (&stream->lock);
+
+    if (!frame) return NULL;
+    pixbuf = frame->pixbuf;
+    if (delay_ms) *delay_ms = frame->delay_ms;
+    g_free (frame);
+    return pixbuf;
+}
+
+guint meme_gif_stream_get_shown (MemeGifStream *stream) {
+    guint shown;
+
+    g_mutex_lock (&stream->lock);
+    shown = stream->shown;
+    g_mutex_unlock (&stream->lock);
+    return shown;
+}
+
+void meme_gif_stream_set_ops (MemeGifStream *stream, const GArray *ops) {
+    g_mutex_lock (&stream->lock);
+    g_array_set_size (stream->ops, 0);
+    if (ops) g_array_append_vals (stream->ops, ops->data, ops->len);
+    g_queue_clear_full (&stream->ring, stream_frame_free);
+    stream->serial++;
+    g_cond_broadcast (&stream->cond);
+    g_mutex_unlock (&stream->lock);
+}
@@ -0,0 +1,43 @@
+/* meme-gif-stream.h
+ *
+ * Copyright 2025 Giovanni
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#pragma once
+#include "meme-gif-frames.h"
+
+/* Playback of a MemeGifFrames: a worker thread decodes a few frames ahead
+ * of whoever pulls them, so memory is a handful of frames however long
+ * the animation is. Frames come out in display order, looping, with the
+ * template operations applied. */
+typedef struct _MemeGifStream MemeGifStream;
+
+MemeGifStream *meme_gif_stream_new (MemeGifFrames *frames, const GArray *ops);
+void meme_gif_stream_free (MemeGifStream *stream);
+
+// Frames in one loop: -1 while the file is still being read, 0 if it can't be.
+int meme_gif_stream_get_n_frames (MemeGifStream *stream);
+
+/* The next frame, owned by the caller, and how long to show it. Without
+ * `wait` NULL means it isn't decoded yet; with it, NULL only comes when
+ * the file can't be decoded. */
+GdkPixbuf *meme_gif_stream_pop (MemeGifStream *stream, gboolean wait, int *delay_ms);
+// Index of the frame last popped, 0 before the first.
+guint meme_gif_stream_get_shown (MemeGifStream *stream);
+
+// MemeTemplateOp to apply from now on; frames already decoded are redone.
+void meme_gif_stream_set_ops (MemeGifStream *stream, const GArray *ops);
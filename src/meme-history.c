@@ -0,0 +1,298 @@
+/* meme-history.c
+ *
+ * Copyright 2025 Giovanni
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#include "meme-history.h"
+#include <string.h>
+
+// A layer as it was when snapshotted, shared by every snapshot it is in.
+typedef struct {
+    ImageLayer *layer;
+    gsize bytes;
+    guint ref_count;
+} FrozenLayer;
+
+typedef struct {
+    GPtrArray *layers;       // FrozenLayer, bottom to top
+    MemeTemplateOp op;       // done to the template right after the snapshot
+} Snapshot;
+
+struct _MemeHistory {
+    GQueue undo, redo;       // Snapshot, newest at the head
+    GHashTable *latest;      // layer id -> its newest FrozenLayer, unowned
+    GHashTable *pixbufs;     // GdkPixbuf -> number of frozen layers using it
+    Snapshot *pending;       // state at the start of the open transaction
+    guint depth;
+    gsize bytes;
+    gsize limit;
+};
+
+static FrozenLayer *frozen_new (MemeHistory *history, const ImageLayer *layer) {
+    FrozenLayer *frozen = g_new0 (FrozenLayer, 1);
+    guint users;
+
+    frozen->layer = meme_layer_copy (layer);
+    frozen->bytes = sizeof (FrozenLayer) + sizeof (ImageLayer);
+    if (layer->text) frozen->bytes += strlen (layer->text) + 1;
+    if (layer->font_family) frozen->bytes += strlen (layer->font_family) + 1;
+    frozen->ref_count = 1;
+    history->bytes += frozen->bytes;
+
+    // pixels are charged once however many layers and snapshots share them
+    if (layer->pixbuf) {
+        users = GPOINTER_TO_UINT (g_hash_table_lookup (history->pixbufs, layer->pixbuf));
+        if (!users) history->bytes += gdk_pixbuf_get_byte_length (layer->pixbuf);
+        g_hash_table_insert (history->pixbufs, layer->pixbuf, GUINT_TO_POINTER (users + 1));
+    }
+    g_hash_table_insert (history->latest, GUINT_TO_POINTER (layer->id), frozen);
+    return frozen;
+}
+
+static void frozen_unref (MemeHistory *history, FrozenLayer *frozen) {
+    GdkPixbuf *pixbuf = frozen->layer->pixbuf;
+    guint users;
+
+    if (--frozen->ref_count) return;
+
+    history->bytes -= frozen->bytes;
+    if (pixbuf) {
+        users = GPOINTER_TO_UINT (g_hash_table_lookup (history->pixbufs, pixbuf)) - 1;
+        if (users) {
+            g_hash_table_insert (history->pixbufs, pixbuf, GUINT_TO_POINTER (users));
+        } else {
+            g_hash_table_remove (history->pixbufs, pixbuf);
+            history->bytes -= gdk_pixbuf_get_byte_length (pixbuf);
+        }
+    }
+    if (g_hash_table_lookup (history->latest, GUINT_TO_POINTER (frozen->layer->id)) == frozen)
+        g_hash_table_remove (history->latest, GUINT_TO_POINTER (frozen->layer->id));
+    meme_layer_free (frozen->layer);
+    g_free (frozen);
+}
+
+// Same generation means same state, except for sizes text measuring fills in later.
+static gboolean frozen_matches (const FrozenLayer *frozen, const ImageLayer *layer) {
+    return frozen && frozen->layer->generation == layer->generation &&
+           frozen->layer->width == layer->width && frozen->layer->height == layer->height;
+}
+
+static Snapshot *snapshot_new (MemeHistory *history, const MemeLayerStore *layers) {
+    Snapshot *snapshot = g_new0 (Snapshot, 1);
+    guint n = meme_layer_store_len (layers);
+
+    snapshot->layers = g_ptr_array_sized_new (n);
+    for (guint i = 0; i < n; i++) {
+        const ImageLayer *layer = meme_layer_store_get (layers, i);
+        FrozenLayer *frozen = g_hash_table_lookup (history->latest, GUINT_TO_POINTER (layer->id));
+
+        if (frozen_matches (frozen, layer))
+            frozen->ref_count++;
+        else
+            frozen = frozen_new (history, layer);
+        g_ptr_array_add (snapshot->layers, frozen);
+    }
+    history->bytes += sizeof (Snapshot) + n * sizeof (gpointer);
+    return snapshot;
+}
+
+static void snapshot_free (MemeHistory *history, Snapshot *snapshot) {
+    history->bytes -= sizeof (Snapshot) + snapshot->layers->len * sizeof (gpointer);
+    for (guint i = 0; i < snapshot->layers->len; i++)
+        frozen_unref (history, g_ptr_array_index (snapshot->layers, i));
+    g_ptr_array_unref (snapshot->layers);
+    g_free (snapshot);
+}
+
+// Whether `layers` is still in the recorded state.
+static gboolean snapshot_unchanged (const Snapshot *snapshot, const MemeLayerStore *layers) {
+    if (snapshot->layers->len != meme_layer_store_len (layers)) return FALSE;
+    for (guint i = 0; i < snapshot->layers->len; i++) {
+        const FrozenLayer *frozen = g_ptr_array_index (snapshot->layers, i);
+        const ImageLayer *layer = meme_layer_store_get (layers, i);
+
+        if (frozen->layer->id != layer->id || frozen->layer->generation != layer->generation)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Puts `snapshot`'s layers into `layers`. Live layers that are still in
+ * the recorded state are kept as they are, the rest are thawed copies. */
+static void snapshot_restore (const Snapshot *snapshot, MemeLayerStore *layers) {
+    GHashTable *live = g_hash_table_new (NULL, NULL);
+    GPtrArray *restored = g_ptr_array_new_full (snapshot->layers->len, meme_layer_free);
+
+    for (guint i = 0; i < meme_layer_store_len (layers); i++)
+        g_hash_table_insert (live, GUINT_TO_POINTER (meme_layer_store_get (layers, i)->id), GUINT_TO_POINTER (i + 1));
+
+    for (guint i = 0; i < snapshot->layers->len; i++) {
+        const FrozenLayer *frozen = g_ptr_array_index (snapshot->layers, i);
+        guint at = GPOINTER_TO_UINT (g_hash_table_lookup (live, GUINT_TO_POINTER (frozen->layer->id)));
+        ImageLayer *layer = at ? meme_layer_store_get (layers, at - 1) : NULL;
+
+        if (layer && frozen_matches (frozen, layer)) {
+            g_ptr_array_index (layers->layers, at - 1) = NULL;
+            g_ptr_array_add (restored, layer);
+        } else {
+            g_ptr_array_add (restored, meme_layer_copy (frozen->layer));
+        }
+    }
+    meme_layer_store_set_layers (layers, restored);
+    g_hash_table_unref (live);
+}
+
+static void trim (MemeHistory *history) {
+    while (history->bytes > history->limit && history->undo.length > 1)
+        snapshot_free (history, g_queue_pop_tail (&history->undo));
+}
+
+MemeHistory *meme_history_new (void) {
+    MemeHistory *history = g_new0 (MemeHistory, 1);
+
+    g_queue_init (&history->undo);
+    g_queue_init (&history->redo);
+    history->latest = g_hash_table_new (NULL, NULL);
+    history->pixbufs = g_hash_table_new (NULL, NULL);
+    history->limit = G_MAXSIZE;
+    return history;
+}
+
+void meme_history_clear (MemeHistory *history) {
+    Snapshot *snapshot;
+
+    if (history->pending) snapshot_free (history, history->pending);
+    history->pending = NULL;
+    history->depth = 0;
+
+    while ((snapshot = g_queue_pop_head (&history->undo)))
+        snapshot_free (history, snapshot);
+    while ((snapshot = g_queue_pop_head (&history->redo)))
+        snapshot_free (history, snapshot);
+}
+
+void meme_history_free (MemeHistory *history) {
+    if (!history) return;
+    meme_history_clear (history);
+    g_hash_table_unref (history->latest);
+    g_hash_table_unref (history->pixbufs);
+    g_free (history);
+}
+
+void meme_history_set_limit (MemeHistory *history, gsize bytes) {
+    history->limit = bytes;
+    trim (history);
+}
+
+void meme_history_begin (MemeHistory *history, const MemeLayerStore *layers) {
+    if (history->depth++ == 0)
+        history->pending = snapshot_new (history, layers);
+}
+
+static gboolean finish (MemeHistory *history, const MemeLayerStore *layers) {
+    Snapshot *snapshot = history->pending;
+
+    history->pending = NULL;
+    history->depth = 0;
+    if (!snapshot) return FALSE;
+    if (snapshot_unchanged (snapshot, layers)) {
+        snapshot_free (history, snapshot);
+        return FALSE;
+    }
+    meme_history_drop_redo (history);
+    g_queue_push_head (&history->undo, snapshot);
+    trim (history);
+    return TRUE;
+}
+
+// TRUE when a step was recorded.
+gboolean meme_history_commit (MemeHistory *history, const MemeLayerStore *layers) {
+    if (!history->depth || --history->depth) return FALSE;
+    return finish (history, layers);
+}
+
+void meme_history_abort (MemeHistory *history, MemeLayerStore *layers) {
+    Snapshot *snapshot = history->pending;
+
+    history->pending = NULL;
+    history->depth = 0;
+    if (!snapshot) return;
+    if (!snapshot_unchanged (snapshot, layers))
+        snapshot_restore (snapshot, layers);
+    snapshot_free (history, snapshot);
+}
+
+gboolean meme_history_in_transaction (const MemeHistory *history) {
+    return history->depth > 0;
+}
+
+gboolean meme_history_can_undo (const MemeHistory *history) {
+    return history->undo.length > 0;
+}
+
+gboolean meme_history_can_redo (const MemeHistory *history) {
+    return history->redo.length > 0;
+}
+
+void meme_history_drop_redo (MemeHistory *history) {
+    Snapshot *snapshot;
+
+    while ((snapshot = g_queue_pop_head (&history->redo)))
+        snapshot_free (history, snapshot);
+}
+
+void meme_history_push (MemeHistory *history, const MemeLayerStore *layers) {
+    meme_history_push_template (history, layers, NULL);
+}
+
+void meme_history_push_template (MemeHistory *history, const MemeLayerStore *layers, const MemeTemplateOp *op) {
+    Snapshot *snapshot;
+
+    finish (history, layers);
+    meme_history_drop_redo (history);
+    snapshot = snapshot_new (history, layers);
+    if (op) snapshot->op = *op;
+    g_queue_push_head (&history->undo, snapshot);
+    trim (history);
+}
+
+// Moves the current state onto `to` and restores the newest step of `from`.
+// The template operation travels with it, it sits between the two states.
+static gboolean step (MemeHistory *history, GQueue *from, GQueue *to, MemeLayerStore *layers, MemeTemplateOp *op) {
+    Snapshot *snapshot;
+    Snapshot *current;
+
+    finish (history, layers);
+    snapshot = g_queue_pop_head (from);
+    if (!snapshot) return FALSE;
+    current = snapshot_new (history, layers);
+    current->op = snapshot->op;
+    if (op) *op = snapshot->op;
+    g_queue_push_head (to, current);
+    snapshot_restore (snapshot, layers);
+    snapshot_free (history, snapshot);
+    trim (history);
+    return TRUE;
+}
+
+gboolean meme_history_undo (MemeHistory *history, MemeLayerStore *layers, MemeTemplateOp *op) {
+    return step (history, &history->undo, &history->redo, layers, op);
+}
+
+gboolean meme_history_redo (MemeHistory *history, MemeLayerStore *layers, MemeTemplateOp *op) {
+    return step (history, &history->redo, &history->undo, layers, op);
+}
@@ -0,0 +1,61 @@
+/* meme-history.h
+ *
+ * Copyright 2025 Giovanni
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#pragma once
+#include "meme-layer-store.h"
+
+/* Undo/redo of the layer stack. Snapshots hold frozen copies of the
+ * layers, and a layer whose generation hasn't moved since the last
+ * snapshot is shared with it, so pushing costs one copy per changed layer.
+ * The history is bounded by the memory it keeps alive rather than by a
+ * step count: the oldest undo steps are dropped once over the limit.
+ * Template rotations, flips and crops are recorded as the operation, not
+ * as pixels; undoing and redoing hands it back to the caller to revert or
+ * replay. */
+typedef struct _MemeHistory MemeHistory;
+
+MemeHistory *meme_history_new (void);
+void meme_history_free (MemeHistory *history);
+void meme_history_clear (MemeHistory *history);
+
+// Budget in bytes. The newest undo step is kept even when it alone is over.
+void meme_history_set_limit (MemeHistory *history, gsize bytes);
+
+// Records `layers` as an undo step and drops the redo steps.
+void meme_history_push (MemeHistory *history, const MemeLayerStore *layers);
+// Same, for a step that is about to apply `op` to the template.
+void meme_history_push_template (MemeHistory *history, const MemeLayerStore *layers, const MemeTemplateOp *op);
+void meme_history_drop_redo (MemeHistory *history);
+/* Transactions fold a gesture (a drag, a slider scrub, a typing burst)
+ * into one undo step: begin snapshots the layers once, commit records that
+ * snapshot only if some layer changed since, abort puts it back. They
+ * nest; only the outermost commit counts. A push, undo, redo or clear
+ * commits an open transaction first. */
+void meme_history_begin (MemeHistory *history, const MemeLayerStore *layers);
+gboolean meme_history_commit (MemeHistory *history, const MemeLayerStore *layers);
+void meme_history_abort (MemeHistory *history, MemeLayerStore *layers);
+gboolean meme_history_in_transaction (const MemeHistory *history);
+
+gboolean meme_history_can_undo (const MemeHistory *history);
+gboolean meme_history_can_redo (const MemeHistory *history);
+/* Both put `layers` back to a recorded state; FALSE when there is none.
+ * `op` (may be NULL) receives the template operation of the step, to be
+ * reverted after an undo and applied again after a redo. */
+gboolean meme_history_undo (MemeHistory *history, MemeLayerStore *layers, MemeTemplateOp *op);
+gboolean meme_history_redo (MemeHistory *history, MemeLayerStore *layers, MemeTemplateOp *op);
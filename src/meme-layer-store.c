@@ -0,0 +1,306 @@
+/* meme-layer-store.c
+ *
+ * Copyright 2025 Giovanni
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#include "meme-layer-store.h"
+#include <math.h>
+
+// Cells per side of the hit-testing grid.
+#define GRID_SIZE 16
+
+MemeLayerStore *meme_layer_store_new (void) {
+    MemeLayerStore *store = g_new0 (MemeLayerStore, 1);
+
+    store->layers = g_ptr_array_new_with_free_func (meme_layer_free);
+    store->bounds = g_array_new (FALSE, TRUE, sizeof (MemeLayerBounds));
+    store->ids = g_hash_table_new (NULL, NULL);
+    store->remeasure = g_array_new (FALSE, FALSE, sizeof (guint));
+    store->next_id = 1;
+    store->grid_stale = TRUE;
+    store->ids_stale = TRUE;
+    return store;
+}
+
+static void grid_free (MemeLayerStore *store) {
+    if (!store->grid) return;
+    for (int i = 0; i < GRID_SIZE * GRID_SIZE; i++)
+        g_array_unref (store->grid[i]);
+    g_clear_pointer (&store->grid, g_free);
+}
+
+void meme_layer_store_free (MemeLayerStore *store) {
+    if (!store) return;
+    g_ptr_array_unref (store->layers);
+    g_array_unref (store->bounds);
+    grid_free (store);
+    g_hash_table_unref (store->ids);
+    g_array_unref (store->remeasure);
+    g_free (store);
+}
+
+// Layers were added, removed or reordered.
+static void structure_changed (MemeLayerStore *store) {
+    store->grid_stale = TRUE;
+    store->ids_stale = TRUE;
+}
+
+void meme_layer_store_clear (MemeLayerStore *store) {
+    g_ptr_array_set_size (store->layers, 0);
+    g_array_set_size (store->bounds, 0);
+    structure_changed (store);
+}
+
+// Index of the layer with `id`, or -1.
+static int lookup (MemeLayerStore *store, guint id) {
+    if (store->ids_stale) {
+        g_hash_table_remove_all (store->ids);
+        for (guint i = 0; i < store->layers->len; i++) {
+            const ImageLayer *layer = g_ptr_array_index (store->layers, i);
+
+            g_hash_table_insert (store->ids, GUINT_TO_POINTER (layer->id), GUINT_TO_POINTER (i + 1));
+        }
+        store->ids_stale = FALSE;
+    }
+    return (int) GPOINTER_TO_UINT (g_hash_table_lookup (store->ids, GUINT_TO_POINTER (id))) - 1;
+}
+
+int meme_layer_store_index_of (MemeLayerStore *store, const ImageLayer *layer) {
+    int i;
+
+    if (!layer) return -1;
+    i = lookup (store, layer->id);
+    // a copy of the layer carries the same id
+    return i >= 0 && g_ptr_array_index (store->layers, i) == layer ? i : -1;
+}
+
+ImageLayer *meme_layer_store_find (MemeLayerStore *store, guint id) {
+    int i = lookup (store, id);
+
+    return i >= 0 ? g_ptr_array_index (store->layers, i) : NULL;
+}
+
+// Puts `layer` on top and takes ownership of it.
+void meme_layer_store_append (MemeLayerStore *store, ImageLayer *layer) {
+    if (!layer->id) layer->id = store->next_id++;
+    g_ptr_array_add (store->layers, layer);
+    g_array_set_size (store->bounds, store->layers->len);
+    structure_changed (store);
+}
+
+// Removes and frees `layer`.
+void meme_layer_store_remove (MemeLayerStore *store, ImageLayer *layer) {
+    int i = meme_layer_store_index_of (store, layer);
+
+    if (i < 0) return;
+    g_array_remove_index (store->bounds, i);
+    g_ptr_array_remove_index (store->layers, i);
+    structure_changed (store);
+}
+
+// Changes the z-order: the layer at `from` ends up at `to`.
+void meme_layer_store_move (MemeLayerStore *store, guint from, guint to) {
+    gpointer layer;
+    MemeLayerBounds bounds;
+
+    if (from == to || from >= store->layers->len || to >= store->layers->len) return;
+
+    layer = g_ptr_array_steal_index (store->layers, from);
+    g_ptr_array_insert (store->layers, to, layer);
+    bounds = g_array_index (store->bounds, MemeLayerBounds, from);
+    g_array_remove_index (store->bounds, from);
+    g_array_insert_val (store->bounds, to, bounds);
+    structure_changed (store);
+}
+
+void meme_layer_store_set_layers (MemeLayerStore *store, GPtrArray *layers) {
+    for (guint i = 0; i < layers->len; i++) {
+        ImageLayer *layer = g_ptr_array_index (layers, i);
+
+        if (layer->id >= store->next_id) store->next_id = layer->id + 1;
+    }
+    g_ptr_array_unref (store->layers);
+    store->layers = layers;
+    g_array_set_size (store->bounds, 0);
+    g_array_set_size (store->bounds, layers->len);
+    structure_changed (store);
+}
+
+void meme_layer_store_invalidate_layer (MemeLayerStore *store, guint index) {
+    if (index < store->layers->len) g_array_append_val (store->remeasure, index);
+}
+
+static void measure (MemeLayerBounds *b, const ImageLayer *layer, double img_w, double img_h) {
+    double ex, ey;
+
+    b->cx = layer->x * img_w;
+    b->cy = layer->y * img_h;
+    b->hw = layer->width * layer->scale / 2.0;
+    b->hh = layer->height * layer->scale / 2.0;
+    b->cos_r = cos (layer->rotation);
+    b->sin_r = sin (layer->rotation);
+    b->generation = layer->generation;
+    b->width = layer->width;
+    b->height = layer->height;
+
+    // cells under the axis-aligned hull of the rotated box
+    ex = fabs (b->hw * b->cos_r) + fabs (b->hh * b->sin_r);
+    ey = fabs (b->hw * b->sin_r) + fabs (b->hh * b->cos_r);
+    b->cell_x0 = CLAMP ((int) floor ((b->cx - ex) / img_w * GRID_SIZE), 0, GRID_SIZE - 1);
+    b->cell_x1 = CLAMP ((int) floor ((b->cx + ex) / img_w * GRID_SIZE), 0, GRID_SIZE - 1);
+    b->cell_y0 = CLAMP ((int) floor ((b->cy - ey) / img_h * GRID_SIZE), 0, GRID_SIZE - 1);
+    b->cell_y1 = CLAMP ((int) floor ((b->cy + ey) / img_h * GRID_SIZE), 0, GRID_SIZE - 1);
+}
+
+static void grid_insert (MemeLayerStore *store, const MemeLayerBounds *b, guint index) {
+    for (int y = b->cell_y0; y <= b->cell_y1; y++) {
+        for (int x = b->cell_x0; x <= b->cell_x1; x++) {
+            GArray *cell = store->grid[y * GRID_SIZE + x];
+            guint at = cell->len;
+
+            while (at > 0 && g_array_index (cell, guint, at - 1) > index) at--;
+            g_array_insert_val (cell, at, index);
+        }
+    }
+}
+
+static void grid_remove (MemeLayerStore *store, const MemeLayerBounds *b, guint index) {
+    for (int y = b->cell_y0; y <= b->cell_y1; y++) {
+        GArray **row = store->grid + y * GRID_SIZE;
+
+        for (int x = b->cell_x0; x <= b->cell_x1; x++) {
+            for (guint k = 0; k < row[x]->len; k++) {
+                if (g_array_index (row[x], guint, k) == index) {
+                    g_array_remove_index (row[x], k);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Re-bins layer `i` if it moved or changed size since it was measured.
+static void update (MemeLayerStore *store, guint i, double img_w, double img_h) {
+    const ImageLayer *layer = g_ptr_array_index (store->layers, i);
+    MemeLayerBounds *b = &g_array_index (store->bounds, MemeLayerBounds, i);
+
+    if (b->generation == layer->generation && b->width == layer->width && b->height == layer->height)
+        return;
+    grid_remove (store, b, i);
+    measure (b, layer, img_w, img_h);
+    grid_insert (store, b, i);
+}
+
+/* Brings boxes and grid up to date. Structural changes and a new template
+ * size rebuild everything. Otherwise only the layers given a generation
+ * since the last sync, found through the layer change log, and the ones
+ * re-measured in between are re-binned; the whole array is only walked
+ * when more changes happened than the log remembers. */
+static void sync (MemeLayerStore *store, double img_w, double img_h) {
+    gboolean rebuild = store->grid_stale || !store->grid || store->grid_w != img_w || store->grid_h != img_h;
+    guint64 now = meme_layer_generation_now ();
+
+    if (!rebuild && store->synced == now && !store->remeasure->len) return;
+
+    if (!store->grid) {
+        store->grid = g_new (GArray *, GRID_SIZE * GRID_SIZE);
+        for (int i = 0; i < GRID_SIZE * GRID_SIZE; i++)
+            store->grid[i] = g_array_new (FALSE, FALSE, sizeof (guint));
+    }
+
+    if (rebuild) {
+        for (int i = 0; i < GRID_SIZE * GRID_SIZE; i++)
+            g_array_set_size (store->grid[i], 0);
+        for (guint i = 0; i < store->layers->len; i++) {
+            MemeLayerBounds *b = &g_array_index (store->bounds, MemeLayerBounds, i);
+
+            measure (b, g_ptr_array_index (store->layers, i), img_w, img_h);
+            grid_insert (store, b, i);
+        }
+    } else if (now - store->synced < MEME_LAYER_CHANGE_LOG) {
+        for (guint64 g = store->synced + 1; g <= now; g++) {
+            int i = lookup (store, meme_layer_changed_id (g));
+
+            if (i >= 0) update (store, i, img_w, img_h);
+        }
+        for (guint k = 0; k < store->remeasure->len; k++)
+            update (store, g_array_index (store->remeasure, guint, k), img_w, img_h);
+    } else {
+        for (guint i = 0; i < store->layers->len; i++)
+            update (store, i, img_w, img_h);
+    }
+
+    g_array_set_size (store->remeasure, 0);
+    store->grid_w = img_w;
+    store->grid_h = img_h;
+    store->grid_stale = FALSE;
+    store->synced = now;
+}
+
+// Point in the box's own frame.
+static void to_local (const MemeLayerBounds *b, double px, double py, double *u, double *v) {
+    double dx = px - b->cx, dy = py - b->cy;
+
+    *u = b->cos_r * dx + b->sin_r * dy;
+    *v = -b->sin_r * dx + b->cos_r * dy;
+}
+
+// Index of the topmost layer whose rotated box contains the point, or -1.
+int meme_layer_store_hit (MemeLayerStore *store, double px, double py, double img_w, double img_h) {
+    GArray *cell;
+    int cx, cy;
+
+    if (px < 0 || py < 0 || px >= img_w || py >= img_h) return -1;
+    sync (store, img_w, img_h);
+
+    cx = CLAMP ((int) (px / img_w * GRID_SIZE), 0, GRID_SIZE - 1);
+    cy = CLAMP ((int) (py / img_h * GRID_SIZE), 0, GRID_SIZE - 1);
+    cell = store->grid[cy * GRID_SIZE + cx];
+    for (guint k = cell->len; k > 0; k--) {
+        guint i = g_array_index (cell, guint, k - 1);
+        const MemeLayerBounds *b = &g_array_index (store->bounds, MemeLayerBounds, i);
+        double u, v;
+
+        to_local (b, px, py, &u, &v);
+        if (fabs (u) <= b->hw && fabs (v) <= b->hh) return i;
+    }
+    return -1;
+}
+
+// Which corner of layer `layer`'s rotated box is within `radius` of the point.
+ResizeHandle meme_layer_store_corner_at (MemeLayerStore *store, int layer, double px, double py,
+                                         double radius, double img_w, double img_h) {
+    const MemeLayerBounds *b;
+    double u, v;
+    gboolean left, right, top, bottom;
+
+    if (layer < 0 || (guint) layer >= store->layers->len) return HANDLE_NONE;
+    sync (store, img_w, img_h);
+
+    b = &g_array_index (store->bounds, MemeLayerBounds, layer);
+    to_local (b, px, py, &u, &v);
+    left = fabs (u + b->hw) < radius;
+    right = fabs (u - b->hw) < radius;
+    top = fabs (v + b->hh) < radius;
+    bottom = fabs (v - b->hh) < radius;
+
+    if (top && left) return HANDLE_TOP_LEFT;
+    if (top && right) return HANDLE_TOP_RIGHT;
+    if (bottom && left) return HANDLE_BOTTOM_LEFT;
+    if (bottom && right) return HANDLE_BOTTOM_RIGHT;
+    return HANDLE_NONE;
+}
@@ -0,0 +1,80 @@
+/* meme-layer-store.h
+ *
+ * Copyright 2025 Giovanni
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#pragma once
+#include "meme-core.h"
+
+// A layer's rotated box in template pixels, for hit-testing.
+typedef struct {
+    double cx, cy;          // centre
+    double hw, hh;          // half extents before rotation
+    double cos_r, sin_r;
+
+    /*< private >*/
+    guint64 generation;
+    double width, height;
+    int cell_x0, cell_y0, cell_x1, cell_y1;
+} MemeLayerBounds;
+
+/* The editor's layers, bottom to top, in one array with O(1) indexed
+ * access. Layers stay heap allocated so pointers to them (the selection, a
+ * drag session) survive reordering; every layer gets an id that is kept by
+ * copies, e.g. in undo snapshots, and an id -> index table makes looking a
+ * layer up by id or pointer O(1) as well. Their boxes are kept in a parallel
+ * compact array and binned into a uniform grid over the template, so a
+ * hit test only looks at the layers overlapping one cell. */
+typedef struct {
+    GPtrArray *layers;       // ImageLayer, owned
+    GArray *bounds;          // MemeLayerBounds, parallel to `layers`
+    guint next_id;
+
+    /*< private >*/
+    GArray **grid;           // per cell, indices of the layers touching it, ascending
+    double grid_w, grid_h;   // template size the grid was built for
+    guint64 synced;          // layer generation counter at the last sync
+    GArray *remeasure;       // indices of layers resized without a new generation
+    gboolean grid_stale;     // layers were added, removed or reordered
+    GHashTable *ids;         // layer id -> index + 1, rebuilt after structural changes
+    gboolean ids_stale;
+} MemeLayerStore;
+
+MemeLayerStore *meme_layer_store_new (void);
+void meme_layer_store_free (MemeLayerStore *store);
+void meme_layer_store_clear (MemeLayerStore *store);
+
+static inline guint meme_layer_store_len (const MemeLayerStore *store) { return store->layers->len; }
+static inline ImageLayer *meme_layer_store_get (const MemeLayerStore *store, guint i) {
+    return g_ptr_array_index (store->layers, i);
+}
+
+int meme_layer_store_index_of (MemeLayerStore *store, const ImageLayer *layer);
+ImageLayer *meme_layer_store_find (MemeLayerStore *store, guint id);
+void meme_layer_store_append (MemeLayerStore *store, ImageLayer *layer);
+void meme_layer_store_remove (MemeLayerStore *store, ImageLayer *layer);
+void meme_layer_store_move (MemeLayerStore *store, guint from, guint to);
+// Replaces all layers with `layers` (ImageLayer, freed with meme_layer_free), taking it.
+void meme_layer_store_set_layers (MemeLayerStore *store, GPtrArray *layers);
+
+// Layer `index` changed size without a new generation (its text was measured).
+void meme_layer_store_invalidate_layer (MemeLayerStore *store, guint index);
+
+// Both take template pixels. `layer` is the index of the layer to test.
+int meme_layer_store_hit (MemeLayerStore *store, double px, double py, double img_w, double img_h);
+ResizeHandle meme_layer_store_corner_at (MemeLayerStore *store, int layer, double px, double py,
+                                         double radius, double img_w, double img_h);
@@ -0,0 +1,341 @@
+/* meme-preview-paintable.c
+ *
+ * Copyright 2025 Giovanni
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#include "meme-preview-paintable.h"
+#include "meme-effects.h"
+#include "meme-text.h"
+
+struct _MemePreviewPaintable {
+    GObject parent_instance;
+
+    MemeScene *scene;
+    GdkPixbuf *background_pixbuf;
+    GdkTexture *background;
+    GPtrArray *layer_textures;      // one texture (or NULL) per scene layer
+    GPtrArray *layer_text;          // cairo node per scene layer, NULL unless text
+    GHashTable *textures;           // layer raster pixbuf -> its texture, kept across scenes
+    GHashTable *text_nodes;         // shape and colours -> TextNode, kept across scenes
+    GdkTexture *composite;          // CPU composite, drawn instead of the nodes when set
+    int width, height;
+};
+
+static void meme_preview_paintable_iface_init (GdkPaintableInterface *iface);
+
+G_DEFINE_FINAL_TYPE_WITH_CODE (MemePreviewPaintable, meme_preview_paintable, G_TYPE_OBJECT,
+                               G_IMPLEMENT_INTERFACE (GDK_TYPE_PAINTABLE, meme_preview_paintable_iface_init))
+
+static GskBlendMode blend_mode (BlendMode mode) {
+    switch (mode) {
+        case BLEND_MULTIPLY: return GSK_BLEND_MODE_MULTIPLY;
+        case BLEND_SCREEN: return GSK_BLEND_MODE_SCREEN;
+        case BLEND_OVERLAY: return GSK_BLEND_MODE_OVERLAY;
+        case BLEND_NORMAL: return GSK_BLEND_MODE_DEFAULT;
+        default: return GSK_BLEND_MODE_DEFAULT;
+    }
+}
+
+/* Text is drawn from its outlines in a cairo node, which GTK rasterizes
+ * at the scale the node ends up on screen, so zoomed text stays sharp.
+ * The node only depends on the shape and colours, so it is kept for as
+ * long as those are and reused by every snapshot and scene; GSK keeps
+ * what it rasterized a node into per scale between frames. */
+typedef struct {
+    MemeTextShape *shape;   // keeps the shape pointer in the key unique
+    GskRenderNode *node;
+} TextNode;
+
+static void text_node_free (gpointer data) {
+    TextNode *text = data;
+
+    meme_text_shape_unref (text->shape);
+    gsk_render_node_unref (text->node);
+    g_free (text);
+}
+
+static TextNode *text_node_new (MemeTextShape *shape, const ImageLayer *layer) {
+    TextNode *text = g_new0 (TextNode, 1);
+    cairo_t *cr;
+
+    text->shape = meme_text_shape_ref (shape);
+    text->node = gsk_cairo_node_new (&GRAPHENE_RECT_INIT (-shape->width / 2.0, -shape->height / 2.0,
+                                                          shape->width, shape->height));
+    cr = gsk_cairo_node_get_draw_context (text->node);
+    cairo_translate (cr, -shape->width / 2.0, -shape->height / 2.0);
+    meme_text_shape_draw (cr, shape, layer);
+    cairo_destroy (cr);
+    return text;
+}
+
+static void snapshot_layer (MemePreviewPaintable *self, GtkSnapshot *snapshot, guint i) {
+    ImageLayer *layer = g_ptr_array_index (self->scene->layers, i);
+    GdkTexture *tex = g_ptr_array_index (self->layer_textures, i);
+    GskRenderNode *text = g_ptr_array_index (self->layer_text, i);
+    double w, h;
+
+    if (!tex && !text) return;
+
+    gtk_snapshot_save (snapshot);
+    gtk_snapshot_translate (snapshot, &GRAPHENE_POINT_INIT (layer->x * self->width, layer->y * self->height));
+    gtk_snapshot_rotate (snapshot, layer->rotation * 180.0 / G_PI);
+    gtk_snapshot_scale (snapshot, layer->scale, layer->scale);
+    if (layer->opacity < 1.0) gtk_snapshot_push_opacity (snapshot, layer->opacity);
+    if (text) {
+        gtk_snapshot_append_node (snapshot, text);
+    } else {
+        w = gdk_texture_get_width (tex);
+        h = gdk_texture_get_height (tex);
+        gtk_snapshot_append_texture (snapshot, tex, &GRAPHENE_RECT_INIT (-w / 2.0, -h / 2.0, w, h));
+    }
+    if (layer->opacity < 1.0) gtk_snapshot_pop (snapshot);
+    gtk_snapshot_restore (snapshot);
+}
+
+// The background and the bottom `n` layers. A layer with a blend mode
+// becomes the top child of a blend node over everything below it.
+static void snapshot_stack (MemePreviewPaintable *self, GtkSnapshot *snapshot, guint n) {
+    ImageLayer *layer;
+
+    if (n == 0) {
+        gtk_snapshot_append_texture (snapshot, self->background,
+                                     &GRAPHENE_RECT_INIT (0, 0, self->width, self->height));
+        return;
+    }
+
+    layer = g_ptr_array_index (self->scene->layers, n - 1);
+    if (layer->blend_mode == BLEND_NORMAL) {
+        snapshot_stack (self, snapshot, n - 1);
+        snapshot_layer (self, snapshot, n - 1);
+        return;
+    }
+
+    gtk_snapshot_push_blend (snapshot, blend_mode (layer->blend_mode));
+    snapshot_stack (self, snapshot, n - 1);
+    gtk_snapshot_pop (snapshot);
+    snapshot_layer (self, snapshot, n - 1);
+    gtk_snapshot_pop (snapshot);
+}
+
+// B&W and cinematic are a colour matrix followed by a linear contrast,
+// both of which GSK does natively. Returns how many nodes to pop.
+static int push_filters (MemePreviewPaintable *self, GtkSnapshot *snapshot) {
+    MemeScene *scene = self->scene;
+    MemeFxChain chain;
+    graphene_matrix_t matrix;
+    graphene_vec4_t offset;
+    int pushed = 0;
+
+    if (scene->cinematic) {
+        float c = meme_fx_contrast_from_magick ((MEME_CINEMATIC_CONTRAST - 1.0) * 50.0);
+
+        graphene_matrix_init_scale (&matrix, c, c, c);
+        graphene_vec4_init (&offset, (1.0f - c) / 2.0f, (1.0f - c) / 2.0f, (1.0f - c) / 2.0f, 0.0f);
+        gtk_snapshot_push_color_matrix (snapshot, &matrix, &offset);
+        pushed++;
+    }
+
+    meme_fx_chain_init (&chain);
+    if (scene->bw)
+        meme_fx_chain_grayscale (&chain);
+    if (scene->cinematic)
+        meme_fx_chain_saturation (&chain, MEME_CINEMATIC_SATURATION);
+    if (chain.has_matrix) {
+        float m[16] = { 0 };
+        int i, j;
+
+        // graphene multiplies row vectors, so input channel j is row j
+        for (i = 0; i < 3; i++)
+            for (j = 0; j < 3; j++)
+                m[j * 4 + i] = chain.matrix.m[i][j];
+        m[15] = 1.0f;
+        graphene_matrix_init_from_float (&matrix, m);
+        gtk_snapshot_push_color_matrix (snapshot, &matrix, graphene_vec4_zero ());
+        pushed++;
+    }
+    return pushed;
+}
+
+static void meme_preview_paintable_snapshot (GdkPaintable *paintable, GdkSnapshot *gdk_snapshot,
+                                             double width, double height) {
+    MemePreviewPaintable *self = MEME_PREVIEW_PAINTABLE (paintable);
+    GtkSnapshot *snapshot = GTK_SNAPSHOT (gdk_snapshot);
+    int pushed;
+
+    if (self->composite) {
+        gtk_snapshot_append_texture (snapshot, self->composite, &GRAPHENE_RECT_INIT (0, 0, width, height));
+        return;
+    }
+    if (!self->background) return;
+
+    gtk_snapshot_save (snapshot);
+    gtk_snapshot_scale (snapshot, width / self->width, height / self->height);
+    pushed = push_filters (self, snapshot);
+    snapshot_stack (self, snapshot, self->layer_textures->len);
+    while (pushed-- > 0)
+        gtk_snapshot_pop (snapshot);
+    gtk_snapshot_restore (snapshot);
+}
+
+static int meme_preview_paintable_get_intrinsic_width (GdkPaintable *paintable) {
+    return MEME_PREVIEW_PAINTABLE (paintable)->width;
+}
+
+static int meme_preview_paintable_get_intrinsic_height (GdkPaintable *paintable) {
+    return MEME_PREVIEW_PAINTABLE (paintable)->height;
+}
+
+static void meme_preview_paintable_iface_init (GdkPaintableInterface *iface) {
+    iface->snapshot = meme_preview_paintable_snapshot;
+    iface->get_intrinsic_width = meme_preview_paintable_get_intrinsic_width;
+    iface->get_intrinsic_height = meme_preview_paintable_get_intrinsic_height;
+}
+
+static void texture_unref (gpointer data) {
+    if (data) g_object_unref (data);
+}
+
+static void meme_preview_paintable_finalize (GObject *object) {
+    MemePreviewPaintable *self = MEME_PREVIEW_PAINTABLE (object);
+
+    g_clear_pointer (&self->scene, meme_scene_unref);
+    g_clear_object (&self->background_pixbuf);
+    g_clear_object (&self->background);
+    g_clear_object (&self->composite);
+    g_ptr_array_unref (self->layer_textures);
+    g_ptr_array_unref (self->layer_text);
+    g_hash_table_unref (self->textures);
+    g_hash_table_unref (self->text_nodes);
+    G_OBJECT_CLASS (meme_preview_paintable_parent_class)->finalize (object);
+}
+
+static void meme_preview_paintable_class_init (MemePreviewPaintableClass *klass) {
+    G_OBJECT_CLASS (klass)->finalize = meme_preview_paintable_finalize;
+}
+
+static void meme_preview_paintable_init (MemePreviewPaintable *self) {
+    self->layer_textures = g_ptr_array_new_with_free_func (texture_unref);
+    self->layer_text = g_ptr_array_new_with_free_func ((GDestroyNotify) gsk_render_node_unref);
+    self->textures = g_hash_table_new_full (g_direct_hash, g_direct_equal, g_object_unref, g_object_unref);
+    self->text_nodes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, text_node_free);
+}
+
+MemePreviewPaintable *meme_preview_paintable_new (void) {
+    return g_object_new (MEME_TYPE_PREVIEW_PAINTABLE, NULL);
+}
+
+// The node of text `layer`, from `nodes` or else carried over from the
+// previous scene's or else drawn, and then left in `nodes`.
+static GskRenderNode *text_node_get (MemePreviewPaintable *self, GHashTable *nodes, const ImageLayer *layer) {
+    MemeTextShape *shape = meme_text_shape (layer, self->width);
+    const GdkRGBA *fill = &layer->text_color, *stroke = &layer->stroke_color;
+    char *key = g_strdup_printf ("%p|%.17g,%.17g,%.17g|%.17g,%.17g,%.17g", (void *) shape,
+                                 fill->red, fill->green, fill->blue, stroke->red, stroke->green, stroke->blue);
+    TextNode *text = g_hash_table_lookup (nodes, key);
+    char *old_key;
+
+    if (text) {
+        g_free (key);
+    } else {
+        if (g_hash_table_steal_extended (self->text_nodes, key, (gpointer *) &old_key, (gpointer *) &text))
+            g_free (old_key);
+        else
+            text = text_node_new (shape, layer);
+        g_hash_table_insert (nodes, key, text);
+    }
+    meme_text_shape_unref (shape);
+    return gsk_render_node_ref (text->node);
+}
+
+// Layer textures are keyed by the raster they were made from, so a layer
+// that only moved keeps its texture (and GTK its upload). Text layers
+// keep their cairo node the same way.
+static void update_layer_textures (MemePreviewPaintable *self) {
+    GHashTable *textures = g_hash_table_new_full (g_direct_hash, g_direct_equal, g_object_unref, g_object_unref);
+    GHashTable *text_nodes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, text_node_free);
+
+    g_ptr_array_set_size (self->layer_textures, 0);
+    g_ptr_array_set_size (self->layer_text, 0);
+    for (guint i = 0; i < self->scene->layers->len; i++) {
+        ImageLayer *layer = g_ptr_array_index (self->scene->layers, i);
+        GdkPixbuf *raster = NULL;
+        GdkTexture *tex = NULL;
+
+        if (layer->type == LAYER_TYPE_TEXT) {
+            g_ptr_array_add (self->layer_text, layer->text ? text_node_get (self, text_nodes, layer) : NULL);
+            g_ptr_array_add (self->layer_textures, NULL);
+            continue;
+        }
+
+        raster = meme_render_layer_raster (layer);
+        if (raster) {
+            tex = g_hash_table_lookup (textures, raster);
+            if (!tex) {
+                tex = g_hash_table_lookup (self->textures, raster);
+                tex = tex ? g_object_ref (tex) : gdk_texture_new_for_pixbuf (raster);
+                g_hash_table_insert (textures, g_object_ref (raster), tex);
+            }
+            g_object_unref (raster);
+        }
+        g_ptr_array_add (self->layer_textures, tex ? g_object_ref (tex) : NULL);
+        g_ptr_array_add (self->layer_text, NULL);
+    }
+    g_hash_table_unref (self->textures);
+    self->textures = textures;
+    g_hash_table_unref (self->text_nodes);
+    self->text_nodes = text_nodes;
+}
+
+void meme_preview_paintable_set_scene (MemePreviewPaintable *self, MemeScene *scene) {
+    int old_w = self->width, old_h = self->height;
+
+    g_clear_object (&self->composite);
+    if (scene) meme_scene_ref (scene);
+    g_clear_pointer (&self->scene, meme_scene_unref);
+    self->scene = scene;
+
+    if (scene && scene->background) {
+        if (scene->background != self->background_pixbuf) {
+            g_set_object (&self->background_pixbuf, scene->background);
+            g_clear_object (&self->background);
+            self->background = gdk_texture_new_for_pixbuf (scene->background);
+        }
+        self->width = gdk_pixbuf_get_width (scene->background);
+        self->height = gdk_pixbuf_get_height (scene->background);
+        update_layer_textures (self);
+    } else {
+        g_clear_object (&self->background_pixbuf);
+        g_clear_object (&self->background);
+        g_ptr_array_set_size (self->layer_textures, 0);
+        g_ptr_array_set_size (self->layer_text, 0);
+        g_hash_table_remove_all (self->textures);
+        g_hash_table_remove_all (self->text_nodes);
+        self->width = self->height = 0;
+    }
+
+    if (self->width != old_w || self->height != old_h)
+        gdk_paintable_invalidate_size (GDK_PAINTABLE (self));
+    gdk_paintable_invalidate_contents (GDK_PAINTABLE (self));
+}
+
+// `composite` may be a fast-mode downscale, it is stretched to the scene size.
+void meme_preview_paintable_set_composite (MemePreviewPaintable *self, GdkPixbuf *composite) {
+    g_clear_object (&self->composite);
+    if (composite)
+        self->composite = gdk_texture_new_for_pixbuf (composite);
+    gdk_paintable_invalidate_contents (GDK_PAINTABLE (self));
+}
@@ -0,0 +1,41 @@
+/* meme-preview-paintable.h
+ *
+ * Copyright 2025 Giovanni
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#pragma once
+
+#include <gtk/gtk.h>
+#include "meme-scene.h"
+#include "meme-renderer.h"
+
+G_BEGIN_DECLS
+
+#define MEME_TYPE_PREVIEW_PAINTABLE (meme_preview_paintable_get_type())
+
+G_DECLARE_FINAL_TYPE (MemePreviewPaintable, meme_preview_paintable, MEME, PREVIEW_PAINTABLE, GObject)
+
+G_END_DECLS
+
+/* The editor preview. A scene is drawn as render nodes: one texture node
+ * for the background and a transform, opacity and blend node per layer, so
+ * moving or fading a layer only changes node parameters and GTK's renderer
+ * does the compositing. Effects that have no node equivalent are rendered
+ * on the CPU and handed over with set_composite(). */
+MemePreviewPaintable *meme_preview_paintable_new (void);
+void meme_preview_paintable_set_scene (MemePreviewPaintable *self, MemeScene *scene);
+void meme_preview_paintable_set_composite (MemePreviewPaintable *self, GdkPixbuf *composite);
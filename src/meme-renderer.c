@@ -2,6 +2,8 @@
 #include "gdk-pixbuf/gdk-pixbuf.h"
 #include "glib.h"
 #include "meme-core.h"
+#include "meme-effects.h"
+#include "meme-text.h"
 #include "pango/pango-layout.h"
 #include "pango/pango-types.h"
 #include <cairo.h>
@@ -63,253 +65,583 @@ meme_get_crop_handle_at_position(double x, double y, double cx, double cy, doubl
 
 GdkPixbuf *meme_apply_saturation_contrast(GdkPixbuf *src, double sat, double contrast) {
     GdkPixbuf *copy;
-    int w, h, stride, n_channels, x, y;
-    guchar *pixels, *row_ptr, *p;
-    int sat_fixed;
-    int inv_sat_fixed;
-    guchar contrast_lut[256];
-
 
     if (!src)
         return NULL;
     copy = gdk_pixbuf_copy(src);
-    w = gdk_pixbuf_get_width(copy);
-    h = gdk_pixbuf_get_height(copy);
-    stride = gdk_pixbuf_get_rowstride(copy);
-    n_channels = gdk_pixbuf_get_n_channels(copy);
-    pixels = gdk_pixbuf_get_pixels(copy);
-
-    for (int i = 0; i < 256; i++) {
-        double val = ((double)i - 128.0) * contrast + 128.0;
-        contrast_lut[i] = CLAMP_U8((int)val);
-    }
+    meme_fx_saturation_contrast(gdk_pixbuf_get_pixels(copy),
+                                gdk_pixbuf_get_width(copy), gdk_pixbuf_get_height(copy),
+                                gdk_pixbuf_get_rowstride(copy), gdk_pixbuf_get_n_channels(copy),
+                                sat, contrast);
+    return copy;
+}
 
-    sat_fixed = (int)(sat * 1024.0);
-    inv_sat_fixed = (int)((1.0 - sat) * 1024.0);
+GdkPixbuf *meme_apply_deep_fry(GdkPixbuf *src, guint32 seed) {
+    if (!src)
+        return NULL;
+    return meme_core_apply_deep_fry(src, seed);
+}
 
-    for (y = 0; y < h; y++) {
-        row_ptr = pixels + (y * stride);
-        for (x = 0; x < w; x++) {
-            int r, g, b;
-            int gray;
-            int rs, gs, bs;
-            p = row_ptr + (x * n_channels);
+/* Resampled layer surfaces, shared by every render. Mip pyramids belong
+ * to a raster, which never changes once made, so the raster itself is
+ * their key. A transformed surface belongs to one layer under one
+ * transform: it is keyed on the layer's id and content generation plus
+ * scale, rotation, opacity, subpixel offset and filter, so layers sharing
+ * a raster and the preview and export of the same layer each keep their
+ * own. All entries
+ * sit on one LRU list and the least recently used go once their surfaces
+ * add up to more than LAYER_CACHE_BUDGET. */
+#define LAYER_CACHE_BUDGET (128 * 1024 * 1024)
+#define LAYER_MAX_MIPS 12
+
+typedef struct {
+    guint id;
+    guint64 content_generation;
+    double scale, rotation, opacity;
+    double frac_x, frac_y;
+    gboolean fast;
+} XformKey;
+
+typedef struct {
+    GList link;                             // in `lru`
+    gsize bytes;
+    GdkPixbuf *raster;                      // set for a pyramid
+    cairo_surface_t *mips[LAYER_MAX_MIPS];  // level k is 1/2^k of the raster, built on demand
+    XformKey key;                           // for a transformed surface
+    cairo_surface_t *xform;
+} LayerEntry;
+
+static void layer_entry_free(gpointer data) {
+    LayerEntry *entry = data;
+
+    for (int i = 0; i < LAYER_MAX_MIPS; i++)
+        g_clear_pointer(&entry->mips[i], cairo_surface_destroy);
+    g_clear_pointer(&entry->xform, cairo_surface_destroy);
+    g_clear_object(&entry->raster);
+    g_free(entry);
+}
 
-            r = p[0], g = p[1], b = p[2];
-            gray = (r * 306 + g * 601 + b * 117) >> 10;
+static guint xform_key_hash(gconstpointer data) {
+    const XformKey *key = data;
 
-            rs = (gray * inv_sat_fixed + r * sat_fixed) >> 10;
-            gs = (gray * inv_sat_fixed + g * sat_fixed) >> 10;
-            bs = (gray * inv_sat_fixed + b * sat_fixed) >> 10;
+    return key->id ^ (guint)(key->content_generation * 0x9E3779B1u) ^ g_double_hash(&key->scale) ^
+           g_double_hash(&key->rotation) ^ ((guint)(key->opacity * 255.0) << 24) ^
+           ((guint)(key->frac_x * 8.0) << 4) ^ ((guint)(key->frac_y * 8.0) << 8) ^ (guint)key->fast;
+}
 
-            p[0] = contrast_lut[CLAMP_U8(rs)];
-            p[1] = contrast_lut[CLAMP_U8(gs)];
-            p[2] = contrast_lut[CLAMP_U8(bs)];
-        }
+static gboolean xform_key_equal(gconstpointer a, gconstpointer b) {
+    const XformKey *ka = a, *kb = b;
+
+    return ka->id == kb->id && ka->content_generation == kb->content_generation && ka->scale == kb->scale &&
+           ka->rotation == kb->rotation && ka->opacity == kb->opacity && ka->frac_x == kb->frac_x &&
+           ka->frac_y == kb->frac_y && ka->fast == kb->fast;
+}
+
+static gsize surface_bytes(cairo_surface_t *surf) {
+    return (gsize)cairo_image_surface_get_stride(surf) * cairo_image_surface_get_height(surf);
+}
+
+struct _MemeRenderCache {
+    GMutex lock;
+    guint64 bg_generation;
+    cairo_surface_t *bg_full;
+    cairo_surface_t *bg_fast;
+    GHashTable *mips;        // GdkPixbuf -> LayerEntry, owns the entries
+    GHashTable *xforms;      // XformKey -> LayerEntry, owns the entries
+    GQueue lru;              // every LayerEntry, most recently used first
+    gsize bytes;             // held by the entries on `lru`
+};
+
+MemeRenderCache *meme_render_cache_new(void) {
+    MemeRenderCache *cache = g_new0(MemeRenderCache, 1);
+
+    g_mutex_init(&cache->lock);
+    cache->mips = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, layer_entry_free);
+    cache->xforms = g_hash_table_new_full(xform_key_hash, xform_key_equal, NULL, layer_entry_free);
+    g_queue_init(&cache->lru);
+    return cache;
+}
+
+void meme_render_cache_free(MemeRenderCache *cache) {
+    if (!cache) return;
+    g_clear_pointer(&cache->bg_full, cairo_surface_destroy);
+    g_clear_pointer(&cache->bg_fast, cairo_surface_destroy);
+    g_hash_table_unref(cache->mips);
+    g_hash_table_unref(cache->xforms);
+    g_mutex_clear(&cache->lock);
+    g_free(cache);
+}
+
+// Marks `entry` as just used. Caller holds the lock.
+static void layer_entry_touch(MemeRenderCache *cache, LayerEntry *entry) {
+    g_queue_unlink(&cache->lru, &entry->link);
+    g_queue_push_head_link(&cache->lru, &entry->link);
+}
+
+// Adds a new entry and trims the cache back under budget, keeping at
+// least the new entry. Caller holds the lock.
+static void layer_entry_insert(MemeRenderCache *cache, LayerEntry *entry) {
+    entry->link.data = entry;
+    g_queue_push_head_link(&cache->lru, &entry->link);
+    if (entry->raster) g_hash_table_insert(cache->mips, entry->raster, entry);
+    else g_hash_table_insert(cache->xforms, &entry->key, entry);
+    cache->bytes += entry->bytes;
+
+    while (cache->bytes > LAYER_CACHE_BUDGET && cache->lru.length > 1) {
+        LayerEntry *old = g_queue_pop_tail_link(&cache->lru)->data;
+
+        cache->bytes -= old->bytes;
+        if (old->raster) g_hash_table_remove(cache->mips, old->raster);
+        else g_hash_table_remove(cache->xforms, &old->key);
     }
-    return copy;
 }
 
-GdkPixbuf *meme_apply_deep_fry(GdkPixbuf *src) {
-    GdkPixbuf *fried = gdk_pixbuf_copy(src);
-    int w = gdk_pixbuf_get_width(fried);
-    int h = gdk_pixbuf_get_height(fried);
-    int nc = gdk_pixbuf_get_n_channels(fried);
-    int rs = gdk_pixbuf_get_rowstride(fried);
-    GdkPixbuf *shrunk, *final;
-    guchar *pixels, *row, *p;
-    double contrast = 2.0;
-    int noise_level = 30;
-    int x, y, i, noise, val;
-    double c_val;
-
-    pixels = gdk_pixbuf_get_pixels(fried);
-
-    for (y = 0; y < h; y++) {
-        row = pixels + y * rs;
-        for (x = 0; x < w; x++) {
-            p = row + x * nc;
-            for (i = 0; i < 3; i++) {
-                noise = (rand() % (noise_level * 2 + 1)) - noise_level;
-                val = p[i] + noise;
-                c_val = ((double)val - 128.0) * contrast + 128.0;
-                p[i] = CLAMP_U8((int)c_val);
-            }
+// What gets drawn for image `layer`, as a new reference (NULL for nothing).
+// Text has no raster, it is drawn from its outlines.
+GdkPixbuf *meme_render_layer_raster(const ImageLayer *layer) {
+    return layer->pixbuf ? g_object_ref(layer->pixbuf) : NULL;
+}
+
+void meme_render_update_text_extents(MemeLayerStore *layers, int bg_width, gboolean all) {
+    for (guint i = 0; i < meme_layer_store_len(layers); i++) {
+        ImageLayer *layer = meme_layer_store_get(layers, i);
+        MemeTextShape *shape;
+
+        if (layer->type != LAYER_TYPE_TEXT || !layer->text) continue;
+        if (!all && !(layer->dirty & (MEME_LAYER_DIRTY_CONTENT | MEME_LAYER_DIRTY_GEOMETRY))) continue;
+        shape = meme_text_shape(layer, bg_width);
+        if (layer->width != shape->width || layer->height != shape->height) {
+            layer->width = shape->width;
+            layer->height = shape->height;
+            meme_layer_store_invalidate_layer(layers, i);
         }
+        meme_text_shape_unref(shape);
     }
+}
 
-    shrunk = gdk_pixbuf_scale_simple(fried, MAX(w * 0.25, 1), MAX(h * 0.25, 1), GDK_INTERP_NEAREST);
-    final = gdk_pixbuf_scale_simple(shrunk, w, h, GDK_INTERP_NEAREST);
-    g_object_unref(fried);
-    g_object_unref(shrunk);
-    return final;
+// Converts (and for the fast preview downscales) the background once.
+static cairo_surface_t *bg_surface_new(GdkPixbuf *bg, cairo_surface_t *full, int w, int h) {
+    cairo_surface_t *surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, w, h);
+    cairo_t *cr = cairo_create(surf);
+    int bg_w = gdk_pixbuf_get_width(bg);
+    int bg_h = gdk_pixbuf_get_height(bg);
+
+    cairo_scale(cr, (double)w / bg_w, (double)h / bg_h);
+    // downscaling from the premultiplied copy skips a second conversion
+    if (full) cairo_set_source_surface(cr, full, 0.0, 0.0);
+    else gdk_cairo_set_source_pixbuf(cr, bg, 0.0, 0.0);
+    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_FAST);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    return surf;
 }
 
-static void meme_layer_ensure_text_pixbuf(ImageLayer *layer, int bg_width) {
-    PangoLayout *layout;
-    PangoLayout *layout2;
+static cairo_surface_t *bg_surface_get(MemeRenderCache *cache, guint64 generation, GdkPixbuf *bg, int w, int h) {
+    cairo_surface_t **slot;
     cairo_surface_t *surf;
-    cairo_t *cr;
-    cairo_surface_t *surf_m;
-    cairo_t *cr_m;
-    int tw;
-    int th;
-    PangoRectangle ink_rect;
-    PangoFontDescription *desc;
-    double max_width;
-
-
-    if (layer->type != LAYER_TYPE_TEXT || !layer->text || layer->pixbuf) return;
-
-    surf_m = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
-    cr_m = cairo_create(surf_m);
-    layout = pango_cairo_create_layout(cr_m);
-    pango_layout_set_text(layout, layer->text, -1);
-    max_width = (bg_width * 0.9) / layer->scale;
-    pango_layout_set_width(layout, max_width * PANGO_SCALE);
-    pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
-    pango_layout_set_alignment(layout, PANGO_ALIGN_CENTER);
-    
-    desc = layer->font_family
-                                     ? pango_font_description_from_string(layer->font_family)
-                                     : pango_font_description_from_string("Sans Bold");
-    pango_font_description_set_absolute_size(desc, layer->font_size * PANGO_SCALE);
-    pango_layout_set_font_description(layout, desc);
-
-    pango_layout_get_pixel_extents(layout, &ink_rect, NULL);
-    tw = ink_rect.width;
-    th = ink_rect.height;
-    layer->width = tw + 10;
-    layer->height = th + 10;
-    
-    g_object_unref(layout);
-    cairo_destroy(cr_m);
-    cairo_surface_destroy(surf_m);
-
-    surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, tw + 10, th + 10);
-    cr = cairo_create(surf);
-    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    gboolean full_size = (w == gdk_pixbuf_get_width(bg) && h == gdk_pixbuf_get_height(bg));
+
+    if (!cache) return bg_surface_new(bg, NULL, w, h);
+
+    g_mutex_lock(&cache->lock);
+    if (cache->bg_generation != generation) {
+        g_clear_pointer(&cache->bg_full, cairo_surface_destroy);
+        g_clear_pointer(&cache->bg_fast, cairo_surface_destroy);
+        cache->bg_generation = generation;
+    }
+
+    slot = full_size ? &cache->bg_full : &cache->bg_fast;
+    if (*slot && (cairo_image_surface_get_width(*slot) != w || cairo_image_surface_get_height(*slot) != h))
+        g_clear_pointer(slot, cairo_surface_destroy);
+    if (!*slot)
+        *slot = bg_surface_new(bg, full_size ? NULL : cache->bg_full, w, h);
+
+    surf = cairo_surface_reference(*slot);
+    g_mutex_unlock(&cache->lock);
+    return surf;
+}
+
+// The fast preview renders at most 800 pixels wide.
+static double composite_scale(int orig_w, gboolean fast_mode) {
+    if (fast_mode && orig_w > 800)
+        return 800.0 / (double)orig_w;
+    return 1.0;
+}
+
+static cairo_operator_t blend_operator(BlendMode mode) {
+    switch (mode) {
+        case BLEND_MULTIPLY: return CAIRO_OPERATOR_MULTIPLY;
+        case BLEND_SCREEN: return CAIRO_OPERATOR_SCREEN;
+        case BLEND_OVERLAY: return CAIRO_OPERATOR_OVERLAY;
+        case BLEND_NORMAL: return CAIRO_OPERATOR_OVER;
+        default: return CAIRO_OPERATOR_OVER;
+    }
+}
+
+static cairo_surface_t *pixbuf_to_surface(GdkPixbuf *pixbuf) {
+    cairo_surface_t *surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                                       gdk_pixbuf_get_width(pixbuf),
+                                                       gdk_pixbuf_get_height(pixbuf));
+    cairo_t *cr = cairo_create(surf);
+
+    gdk_cairo_set_source_pixbuf(cr, pixbuf, 0.0, 0.0);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
     cairo_paint(cr);
-    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
-
-    layout2 = pango_cairo_create_layout(cr);
-    pango_layout_set_text(layout2, layer->text, -1);
-    pango_layout_set_width(layout2, max_width * PANGO_SCALE);
-    pango_layout_set_wrap(layout2, PANGO_WRAP_WORD_CHAR);
-    pango_layout_set_alignment(layout2, PANGO_ALIGN_CENTER);
-    pango_layout_set_font_description(layout2, desc);
-
-    cairo_move_to(cr, 5.0 - ink_rect.x, 5.0 - ink_rect.y);
-    pango_cairo_layout_path(cr, layout2);
-    
-    cairo_set_source_rgba(cr, layer->stroke_color.red, layer->stroke_color.green, layer->stroke_color.blue, 1.0);
-    cairo_set_line_width(cr, layer->font_size * 0.08);
-    cairo_stroke_preserve(cr);
-    cairo_set_source_rgba(cr, layer->text_color.red, layer->text_color.green, layer->text_color.blue, 1.0);
-    cairo_fill(cr);
-    cairo_surface_flush(surf);
+    cairo_destroy(cr);
+    return surf;
+}
 
-    layer->pixbuf = gdk_pixbuf_get_from_surface(surf, 0, 0, tw + 10, th + 10);
+// Next level of the pyramid: half the size, box filtered.
+static cairo_surface_t *mip_down(cairo_surface_t *src) {
+    int sw = cairo_image_surface_get_width(src), sh = cairo_image_surface_get_height(src);
+    int w = MAX(sw / 2, 1), h = MAX(sh / 2, 1);
+    cairo_surface_t *surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, w, h);
+    cairo_t *cr = cairo_create(surf);
+
+    cairo_scale(cr, (double)w / sw, (double)h / sh);
+    cairo_set_source_surface(cr, src, 0.0, 0.0);
+    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_GOOD);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    return surf;
+}
 
+/* The layer scaled to `ds` device pixels per raster pixel, rotated and
+ * faded, in a surface just big enough to hold it. Its centre sits
+ * `frac_x`, `frac_y` past the surface's middle pixel, so the surface is
+ * composited at a whole-pixel offset without being resampled again.
+ * Resampling starts from a mip level at most 2x larger than the result,
+ * so a huge photo shrunk to a sticker never gets filtered at full size. */
+static cairo_surface_t *transform_layer(cairo_surface_t *mip, int raster_w, int raster_h, double ds,
+                                        double rotation, double opacity, double frac_x, double frac_y,
+                                        gboolean fast_mode) {
+    double w = raster_w * ds, h = raster_h * ds;
+    double c = fabs(cos(rotation)), s = fabs(sin(rotation));
+    int xw = (int)ceil(w * c + h * s) + 2;
+    int xh = (int)ceil(w * s + h * c) + 2;
+    int mw = cairo_image_surface_get_width(mip), mh = cairo_image_surface_get_height(mip);
+    cairo_surface_t *surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, xw, xh);
+    cairo_t *cr = cairo_create(surf);
+
+    cairo_translate(cr, xw / 2 + frac_x, xh / 2 + frac_y);
+    cairo_rotate(cr, rotation);
+    cairo_scale(cr, w / mw, h / mh);
+    cairo_set_source_surface(cr, mip, -mw / 2.0, -mh / 2.0);
+    cairo_pattern_set_filter(cairo_get_source(cr), fast_mode ? CAIRO_FILTER_FAST : CAIRO_FILTER_GOOD);
+    if (opacity < 1.0) cairo_paint_with_alpha(cr, opacity);
+    else cairo_paint(cr);
     cairo_destroy(cr);
-    cairo_surface_destroy(surf);
-    g_object_unref(layout2);
-    pango_font_description_free(desc);
+    return surf;
+}
+
+// Returns a new reference to `raster` transformed for `layer`, building
+// and caching whatever part of its pyramid is missing. The cache lock is
+// not held while resampling.
+static cairo_surface_t *layer_transformed(MemeRenderCache *cache, GdkPixbuf *raster, const ImageLayer *layer,
+                                          double ds, double frac_x, double frac_y, gboolean fast_mode) {
+    cairo_surface_t *mips[LAYER_MAX_MIPS] = { NULL };
+    cairo_surface_t *xform = NULL;
+    XformKey key = { layer->id, layer->content_generation, ds, layer->rotation, layer->opacity,
+                     frac_x, frac_y, fast_mode };
+    LayerEntry *entry;
+    int level = 0, have, i;
+
+    while (level + 1 < LAYER_MAX_MIPS && ds * (1 << (level + 1)) <= 1.0)
+        level++;
+
+    if (cache) {
+        g_mutex_lock(&cache->lock);
+        entry = g_hash_table_lookup(cache->xforms, &key);
+        if (entry) {
+            layer_entry_touch(cache, entry);
+            xform = cairo_surface_reference(entry->xform);
+        } else if ((entry = g_hash_table_lookup(cache->mips, raster))) {
+            layer_entry_touch(cache, entry);
+            for (i = 0; i <= level; i++)
+                if (entry->mips[i]) mips[i] = cairo_surface_reference(entry->mips[i]);
+        }
+        g_mutex_unlock(&cache->lock);
+        if (xform) return xform;
+    }
+
+    for (have = level; have > 0 && !mips[have]; have--);
+    if (!mips[have]) mips[have] = pixbuf_to_surface(raster);
+    for (i = have + 1; i <= level; i++)
+        mips[i] = mip_down(mips[i - 1]);
+
+    xform = transform_layer(mips[level], gdk_pixbuf_get_width(raster), gdk_pixbuf_get_height(raster),
+                            ds, layer->rotation, layer->opacity, frac_x, frac_y, fast_mode);
+
+    if (cache) {
+        g_mutex_lock(&cache->lock);
+        entry = g_hash_table_lookup(cache->mips, raster);
+        if (entry) {
+            for (i = 0; i <= level; i++) {
+                if (entry->mips[i] || !mips[i]) continue;
+                entry->mips[i] = cairo_surface_reference(mips[i]);
+                entry->bytes += surface_bytes(mips[i]);
+                cache->bytes += surface_bytes(mips[i]);
+            }
+        } else {
+            entry = g_new0(LayerEntry, 1);
+            entry->raster = g_object_ref(raster);
+            for (i = 0; i <= level; i++) {
+                if (!mips[i]) continue;
+                entry->mips[i] = cairo_surface_reference(mips[i]);
+                entry->bytes += surface_bytes(mips[i]);
+            }
+            layer_entry_insert(cache, entry);
+        }
+
+        if (!g_hash_table_contains(cache->xforms, &key)) {
+            entry = g_new0(LayerEntry, 1);
+            entry->key = key;
+            entry->xform = cairo_surface_reference(xform);
+            entry->bytes = surface_bytes(xform);
+            layer_entry_insert(cache, entry);
+        }
+        g_mutex_unlock(&cache->lock);
+    }
+
+    for (i = 0; i <= level; i++)
+        if (mips[i]) cairo_surface_destroy(mips[i]);
+    return xform;
+}
+
+// Fast previews build outlines at scales a 1/8 octave apart, so a resize
+// gesture keeps hitting the same few masks.
+// Text is stroked and filled from its glyph outlines under the layer
+// transform, the same way the preview draws it. Opaque normal text goes
+// straight onto the composite; otherwise it is drawn into a group the size
+// of its own box, which already holds the stroke.
+static void draw_text_layer(cairo_t *cr, const ImageLayer *layer, double scale, int orig_w, int orig_h) {
+    MemeTextShape *shape = meme_text_shape(layer, orig_w);
+    double ds = layer->scale * scale;
+    gboolean grouped = layer->opacity < 1.0 || layer->blend_mode != BLEND_NORMAL;
+
+    cairo_save(cr);
+    cairo_identity_matrix(cr);
+    cairo_translate(cr, layer->x * orig_w * scale, layer->y * orig_h * scale);
+    cairo_rotate(cr, layer->rotation);
+    cairo_scale(cr, ds, ds);
+    cairo_translate(cr, -shape->width / 2.0, -shape->height / 2.0);
+    if (grouped) {
+        cairo_rectangle(cr, 0, 0, shape->width, shape->height);
+        cairo_clip(cr);
+        cairo_push_group(cr);
+    }
+    meme_text_shape_draw(cr, shape, layer);
+
+    if (grouped) {
+        cairo_pop_group_to_source(cr);
+        cairo_set_operator(cr, blend_operator(layer->blend_mode));
+        cairo_paint_with_alpha(cr, layer->opacity);
+    }
+    cairo_restore(cr);
+    meme_text_shape_unref(shape);
 }
 
-GdkPixbuf *meme_render_composite(GdkPixbuf *bg, GList *layers,
-                                gboolean cinematic,
-                                gboolean deep_fry, gboolean bw,
-                                gboolean fast_mode) {
+// Splits composite coordinate `v` into whole pixels and a fraction. The
+// fraction goes in 1/8 pixel steps, or is rounded away in fast mode, so
+// nearby positions share a transformed surface.
+static double split_subpixel(double v, gboolean fast_mode, double *frac) {
+    double steps = fast_mode ? 1.0 : 8.0;
+    double q = round(v * steps) / steps;
+    double whole = floor(q);
+
+    *frac = q - whole;
+    return whole;
+}
+
+// `cr` is in composite pixels, `scale` is the composite size relative to
+// the full-size template. Unchanged layers are a plain blit of their
+// cached transformed raster.
+static void draw_layer(cairo_t *cr, MemeRenderCache *cache, const ImageLayer *layer,
+                       double scale, int orig_w, int orig_h, gboolean fast_mode) {
+    GdkPixbuf *raster;
+    cairo_surface_t *xform;
+    double px, py, frac_x, frac_y;
+    int cx, cy;
+
+    if (layer->type == LAYER_TYPE_TEXT) {
+        if (layer->text) draw_text_layer(cr, layer, scale, orig_w, orig_h);
+        return;
+    }
+
+    raster = meme_render_layer_raster(layer);
+    if (!raster) return;
+    px = split_subpixel(layer->x * orig_w * scale, fast_mode, &frac_x);
+    py = split_subpixel(layer->y * orig_h * scale, fast_mode, &frac_y);
+    xform = layer_transformed(cache, raster, layer, layer->scale * scale, frac_x, frac_y, fast_mode);
+    g_object_unref(raster);
+
+    cx = (int)px - cairo_image_surface_get_width(xform) / 2;
+    cy = (int)py - cairo_image_surface_get_height(xform) / 2;
+
+    cairo_save(cr);
+    cairo_identity_matrix(cr);
+    cairo_set_operator(cr, blend_operator(layer->blend_mode));
+    cairo_set_source_surface(cr, xform, cx, cy);
+    cairo_paint(cr);
+    cairo_restore(cr);
+    cairo_surface_destroy(xform);
+}
+
+static void paint_surface(cairo_t *cr, cairo_surface_t *src, cairo_operator_t op) {
+    cairo_save(cr);
+    cairo_set_source_surface(cr, src, 0.0, 0.0);
+    cairo_set_operator(cr, op);
+    cairo_paint(cr);
+    cairo_restore(cr);
+}
+
+// Turns the finished surface into the composite pixbuf and runs the
+// global filters on it. The composite is ours, so every filter runs in
+// place in one chain; the fast preview gets them too, laid out in
+// full-size pixels.
+static GdkPixbuf *finish_composite(cairo_surface_t *surf, int render_w, int render_h, double scale,
+                                   gboolean cinematic, gboolean deep_fry, gboolean bw, guint32 seed) {
     GdkPixbuf *comp;
+
+    cairo_surface_flush(surf);
+    comp = gdk_pixbuf_get_from_surface(surf, 0, 0, render_w, render_h);
+
+    if (bw || cinematic || deep_fry)
+        meme_core_apply_effects_in_place(comp, scale, bw, cinematic, deep_fry, seed);
+    return comp;
+}
+
+/* Reads nothing but `scene` and the cache, so any thread can call it and
+ * one scene can be rendered by several at once. Returns NULL once
+ * `cancellable` fires. The crop is not applied, see meme_scene_crop_output(). */
+GdkPixbuf *meme_render_scene(const MemeScene *scene, MemeRenderCache *cache,
+                             gboolean fast_mode, GCancellable *cancellable) {
+    GdkPixbuf *comp = NULL;
     int render_w;
     int render_h;
-    cairo_surface_t *surf;
+    cairo_surface_t *surf, *bg_surf;
     cairo_t *cr;
-    double scale = 1.0;
+    double scale;
     int orig_w;
     int orig_h;
-    if (!bg) return NULL;
-
+    if (!scene->background) return NULL;
 
-    orig_w = gdk_pixbuf_get_width(bg);
-    orig_h  = gdk_pixbuf_get_height(bg);
-
-    for (GList *l = layers; l != NULL; l = l->next) {
-        meme_layer_ensure_text_pixbuf((ImageLayer *)l->data, orig_w);
-    }
 
+    orig_w = gdk_pixbuf_get_width(scene->background);
+    orig_h  = gdk_pixbuf_get_height(scene->background);
 
-    if (fast_mode && orig_w > 800) {
-        scale = 800.0 / (double)orig_w;
-    }
-
+    scale = composite_scale(orig_w, fast_mode);
     render_w = orig_w * scale;
     render_h = orig_h * scale;
     surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, render_w, render_h);
     cr = cairo_create(surf);
 
-    if (scale < 1.0) {
-        GdkPixbuf *scaled_bg = gdk_pixbuf_scale_simple(bg, render_w, render_h, GDK_INTERP_NEAREST);
-        gdk_cairo_set_source_pixbuf(cr, scaled_bg, 0.0, 0.0);
-        cairo_paint(cr);
-        g_object_unref(scaled_bg);
-    } else {
-        gdk_cairo_set_source_pixbuf(cr, bg, 0.0, 0.0);
-        cairo_paint(cr);
+    bg_surf = bg_surface_get(cache, scene->bg_generation, scene->background, render_w, render_h);
+    paint_surface(cr, bg_surf, CAIRO_OPERATOR_SOURCE);
+    cairo_surface_destroy(bg_surf);
+
+    for (guint i = 0; i < scene->layers->len; i++) {
+        if (g_cancellable_is_cancelled(cancellable)) break;
+        draw_layer(cr, cache, g_ptr_array_index(scene->layers, i), scale, orig_w, orig_h, fast_mode);
     }
 
-    cairo_scale(cr, scale, scale);
+    cairo_destroy(cr);
 
-    for (GList *l = layers; l != NULL; l = l->next) {
-        ImageLayer *layer = (ImageLayer *)l->data;
-        cairo_save(cr);
+    if (!g_cancellable_is_cancelled(cancellable))
+        comp = finish_composite(surf, render_w, render_h, scale,
+                                scene->cinematic, scene->deep_fry, scene->bw, scene->seed);
+    cairo_surface_destroy(surf);
+    return comp;
+}
 
-        cairo_translate(cr, layer->x * orig_w, layer->y * orig_h);
-        cairo_rotate(cr, layer->rotation);
-        cairo_scale(cr, layer->scale, layer->scale);
+/* Flattens the layers below `moving` (background included) into one
+ * surface and, when they all use normal blending, the layers above it
+ * into another: OVER is associative, the other blend modes are not, so
+ * those stacks are drawn layer by layer on every frame instead. */
+MemeDragSession *meme_drag_session_new(GdkPixbuf *bg, guint64 bg_generation, MemeLayerStore *layers,
+                                       ImageLayer *moving, MemeRenderCache *cache, gboolean fast_mode) {
+    MemeDragSession *session;
+    int index = meme_layer_store_index_of(layers, moving);
+    guint n = meme_layer_store_len(layers);
+    cairo_surface_t *bg_surf;
+    cairo_t *cr;
+    gboolean flatten_above = TRUE;
+
+    if (!bg || index < 0) return NULL;
+
+    session = g_new0(MemeDragSession, 1);
+    session->layer = moving;
+    session->layers = layers;
+    session->above_index = index + 1;
+    session->cache = cache;
+    session->fast_mode = fast_mode;
+    session->orig_w = gdk_pixbuf_get_width(bg);
+    session->orig_h = gdk_pixbuf_get_height(bg);
+    session->scale = composite_scale(session->orig_w, fast_mode);
+    session->render_w = session->orig_w * session->scale;
+    session->render_h = session->orig_h * session->scale;
+
+    session->below = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, session->render_w, session->render_h);
+    cr = cairo_create(session->below);
+    bg_surf = bg_surface_get(cache, bg_generation, bg, session->render_w, session->render_h);
+    paint_surface(cr, bg_surf, CAIRO_OPERATOR_SOURCE);
+    cairo_surface_destroy(bg_surf);
+    for (int i = 0; i < index; i++)
+        draw_layer(cr, cache, meme_layer_store_get(layers, i), session->scale,
+                   session->orig_w, session->orig_h, fast_mode);
+    cairo_destroy(cr);
 
-        if (layer->blend_mode == BLEND_MULTIPLY) cairo_set_operator(cr, CAIRO_OPERATOR_MULTIPLY);
-        else if (layer->blend_mode == BLEND_SCREEN) cairo_set_operator(cr, CAIRO_OPERATOR_SCREEN);
-        else if (layer->blend_mode == BLEND_OVERLAY) cairo_set_operator(cr, CAIRO_OPERATOR_OVERLAY);
-        else cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+    for (guint i = session->above_index; i < n; i++)
+        if (meme_layer_store_get(layers, i)->blend_mode != BLEND_NORMAL) flatten_above = FALSE;
 
-        if (layer->pixbuf) {
-            cairo_pattern_t *pat;
+    if (session->above_index < n && flatten_above) {
+        session->above = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, session->render_w, session->render_h);
+        cr = cairo_create(session->above);
+        for (guint i = session->above_index; i < n; i++)
+            draw_layer(cr, cache, meme_layer_store_get(layers, i), session->scale,
+                       session->orig_w, session->orig_h, fast_mode);
+        cairo_destroy(cr);
+    }
+    return session;
+}
 
-            gdk_cairo_set_source_pixbuf(cr, layer->pixbuf, -layer->width / 2.0, -layer->height / 2.0);
+GdkPixbuf *meme_drag_session_render(MemeDragSession *session,
+                                    gboolean cinematic, gboolean deep_fry, gboolean bw, guint32 seed) {
+    GdkPixbuf *comp;
+    cairo_surface_t *surf;
+    cairo_t *cr;
 
-            pat = cairo_get_source(cr);
-            cairo_pattern_set_filter(pat, fast_mode ? CAIRO_FILTER_FAST : CAIRO_FILTER_GOOD);
+    surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, session->render_w, session->render_h);
+    cr = cairo_create(surf);
+    paint_surface(cr, session->below, CAIRO_OPERATOR_SOURCE);
 
-            if (layer->opacity < 1.0) cairo_paint_with_alpha(cr, layer->opacity);
-            else cairo_paint(cr);
-        }
-        cairo_restore(cr);
+    // only the position changes during a move, so this is a cache hit
+    draw_layer(cr, session->cache, session->layer, session->scale,
+               session->orig_w, session->orig_h, session->fast_mode);
+    if (session->above) {
+        paint_surface(cr, session->above, CAIRO_OPERATOR_OVER);
+    } else {
+        for (guint i = session->above_index; i < meme_layer_store_len(session->layers); i++)
+            draw_layer(cr, session->cache, meme_layer_store_get(session->layers, i), session->scale,
+                       session->orig_w, session->orig_h, session->fast_mode);
     }
-
-    cairo_surface_flush(surf);
     cairo_destroy(cr);
 
-    comp = gdk_pixbuf_get_from_surface(surf, 0, 0, render_w, render_h);
+    comp = finish_composite(surf, session->render_w, session->render_h, session->scale,
+                            cinematic, deep_fry, bw, seed);
     cairo_surface_destroy(surf);
-
-    if (bw) {
-        GdkPixbuf *tmp = meme_core_apply_black_and_white(comp);
-        g_object_unref(comp);
-        comp = tmp;
-    }
-
-    if (!fast_mode && (cinematic || deep_fry)) {
-        GdkPixbuf *tmp = meme_core_apply_effects(comp, cinematic, deep_fry);
-        if (tmp) {
-            g_object_unref(comp);
-            comp = tmp;
-        }
-    }
     return comp;
 }
 
+void meme_drag_session_free(MemeDragSession *session) {
+    if (!session) return;
+    g_clear_pointer(&session->below, cairo_surface_destroy);
+    g_clear_pointer(&session->above, cairo_surface_destroy);
+    g_free(session);
+}
+
 void meme_draw_crop_chrome (cairo_t *cr, double w, double h,
                              double abs_x, double abs_y, double abs_w, double abs_h) {
     double scale_ref = (w < h ? w : h) / 800.0;
@@ -427,62 +759,29 @@ void meme_draw_crop_chrome (cairo_t *cr, double w, double h,
     cairo_set_line_cap(cr, CAIRO_LINE_CAP_BUTT);
 }
 
-GdkTexture *meme_render_editor_overlay(GdkPixbuf *composite, GList *layers, ImageLayer *selected, gboolean crop_active, double cx, double cy, double cw, double ch) {
-    GdkPixbuf *res;
-    GdkTexture *tex;
-    int w;
-    int h;
-    cairo_surface_t *surf;
-    cairo_t *cr;
-
-    if (!composite)
-        return NULL;
-
-    w = gdk_pixbuf_get_width(composite);
-    h = gdk_pixbuf_get_height(composite);
-    surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, w, h);
-    cr = cairo_create(surf);
-
-    gdk_cairo_set_source_pixbuf(cr, composite, 0, 0);
-    cairo_paint(cr);
-
-    if (crop_active) {
-        meme_draw_crop_chrome(cr, w, h, cx * w, cy * h, cw * w, ch * h);
-    } else if (selected) {
-        double sx = selected->x * w;
-        double sy = selected->y * h;
-        double bw = selected->width * selected->scale;
-        double bh = selected->height * selected->scale;
-        // radius of circles on the visual handler
-        double hr = 6.0;
-
-        cairo_save(cr);
-        cairo_translate(cr, sx, sy);
-        cairo_rotate(cr, selected->rotation);
-
-        cairo_set_source_rgba(cr, 0.0, 0.0, 1.0, 1.0);
-        cairo_set_line_width(cr, 2.0);
-        cairo_rectangle(cr, -bw / 2.0, -bh / 2.0, bw, bh);
-        cairo_stroke(cr);
+// Box and corner handles around a layer centred on (cx, cy), in widget pixels.
+void meme_draw_selection_chrome (cairo_t *cr, double cx, double cy, double w, double h, double rotation) {
+    // radius of circles on the visual handler
+    double hr = 6.0;
 
-        cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
+    cairo_save(cr);
+    cairo_translate(cr, cx, cy);
+    cairo_rotate(cr, rotation);
 
-        cairo_arc(cr, -bw / 2.0, -bh / 2.0, hr, 0, 2 * M_PI);
-        cairo_fill(cr);
-        cairo_arc(cr, bw / 2.0, -bh / 2.0, hr, 0, 2 * M_PI);
-        cairo_fill(cr);
-        cairo_arc(cr, -bw / 2.0, bh / 2.0, hr, 0, 2 * M_PI);
-        cairo_fill(cr);
-        cairo_arc(cr, bw / 2.0, bh / 2.0, hr, 0, 2 * M_PI);
-        cairo_fill(cr);
-        cairo_restore(cr);
-    }
+    cairo_set_source_rgba(cr, 0.0, 0.0, 1.0, 1.0);
+    cairo_set_line_width(cr, 2.0);
+    cairo_rectangle(cr, -w / 2.0, -h / 2.0, w, h);
+    cairo_stroke(cr);
 
-    cairo_destroy(cr);
-    res = gdk_pixbuf_get_from_surface(surf, 0, 0, w, h);
-    cairo_surface_destroy(surf);
+    cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
 
-    tex = gdk_texture_new_for_pixbuf(res);
-    g_object_unref(res);
-    return tex;
-}
\ No newline at end of file
+    cairo_arc(cr, -w / 2.0, -h / 2.0, hr, 0, 2 * M_PI);
+    cairo_fill(cr);
+    cairo_arc(cr, w / 2.0, -h / 2.0, hr, 0, 2 * M_PI);
+    cairo_fill(cr);
+    cairo_arc(cr, -w / 2.0, h / 2.0, hr, 0, 2 * M_PI);
+    cairo_fill(cr);
+    cairo_arc(cr, w / 2.0, h / 2.0, hr, 0, 2 * M_PI);
+    cairo_fill(cr);
+    cairo_restore(cr);
+}
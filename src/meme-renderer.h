@@ -1,21 +1,56 @@
 #pragma once
 #include "meme-core.h"
+#include "meme-scene.h"
 
 void meme_get_image_coordinates (GtkWidget *widget, GdkPixbuf *img, double wx, double wy, double *ix, double *iy);
 ResizeHandle meme_get_crop_handle_at_position(double x, double y, double cx, double cy, double cw, double ch, double rx, double ry);
 
 GdkPixbuf *meme_apply_saturation_contrast (GdkPixbuf *src, double sat, double contrast);
-GdkPixbuf *meme_apply_deep_fry (GdkPixbuf *src);
+GdkPixbuf *meme_apply_deep_fry (GdkPixbuf *src, guint32 seed);
 
 
-GdkPixbuf *meme_render_composite(GdkPixbuf *bg, GList *layers, gboolean cinematic, gboolean deep_fry, gboolean bw, gboolean fast_mode);
+/* Raster data derived from scenes: the premultiplied background (full size
+ * and the fast-mode downscale, kept until the scene's background generation
+ * changes) and per layer raster a mip pyramid plus its last
+ * scaled/rotated/faded copy. Text rasters are shared process-wide, see
+ * meme-text.h. Safe to share between threads. */
+typedef struct _MemeRenderCache MemeRenderCache;
 
-GdkTexture *meme_render_editor_overlay (GdkPixbuf *composite, 
-                                        GList *layers, 
-                                        ImageLayer *selected_layer,
-                                        gboolean crop_active,
-                                        double cx, double cy, double cw, double ch);
+MemeRenderCache *meme_render_cache_new (void);
+void meme_render_cache_free (MemeRenderCache *cache);
 
+/* Rendering never writes to layers; the editor calls this to learn the
+ * size of its text layers for hit-testing and the selection box. Unless
+ * `all` is set only layers with dirty content or geometry are measured. */
+void meme_render_update_text_extents (MemeLayerStore *layers, int bg_width, gboolean all);
+GdkPixbuf *meme_render_layer_raster (const ImageLayer *layer);
+
+GdkPixbuf *meme_render_scene (const MemeScene *scene, MemeRenderCache *cache,
+                              gboolean fast_mode, GCancellable *cancellable);
+
+/* While a layer is being moved nothing else changes, so everything under
+ * it and (blend modes permitting) everything over it is flattened once at
+ * drag start. A frame is then three blits plus the global filters. The
+ * session borrows `layers`: end it before the store or its layers change. */
+typedef struct {
+    ImageLayer *layer;
+    MemeRenderCache *cache;
+    cairo_surface_t *below;
+    cairo_surface_t *above;
+    const MemeLayerStore *layers;
+    guint above_index;       // index of the first layer over the moving one
+    int orig_w, orig_h;
+    int render_w, render_h;
+    double scale;
+    gboolean fast_mode;
+} MemeDragSession;
+
+MemeDragSession *meme_drag_session_new (GdkPixbuf *bg, guint64 bg_generation, MemeLayerStore *layers, ImageLayer *moving,
+                                        MemeRenderCache *cache, gboolean fast_mode);
+GdkPixbuf *meme_drag_session_render (MemeDragSession *session,
+                                     gboolean cinematic, gboolean deep_fry, gboolean bw, guint32 seed);
+void meme_drag_session_free (MemeDragSession *session);
 
 void meme_draw_crop_chrome (cairo_t *cr, double w, double h,
                              double abs_x, double abs_y, double abs_w, double abs_h);
+void meme_draw_selection_chrome (cairo_t *cr, double cx, double cy, double w, double h, double rotation);
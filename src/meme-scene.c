@@ -0,0 +1,160 @@
+/* meme-scene.c
+ *
+ * Copyright 2025 Giovanni
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#include "meme-scene.h"
+
+static MemeScene *scene_alloc (void) {
+    MemeScene *scene = g_new0 (MemeScene, 1);
+    scene->ref_count = 1;
+    scene->crop_w = 1.0;
+    scene->crop_h = 1.0;
+    return scene;
+}
+
+/* A frozen layer copy, shared by every scene built while the layer keeps
+ * its generation. The copy comes first, so scenes hold plain ImageLayer
+ * pointers and meme_layer_free() releases the whole thing. */
+typedef struct {
+    ImageLayer layer;
+    gint ref_count;
+} SharedLayer;
+
+static ImageLayer *shared_layer_new (const ImageLayer *src) {
+    SharedLayer *shared = g_new (SharedLayer, 1);
+    ImageLayer *copy = meme_layer_copy (src);
+
+    // take over the copy's references
+    shared->layer = *copy;
+    shared->ref_count = 1;
+    g_free (copy);
+    return &shared->layer;
+}
+
+static ImageLayer *shared_layer_ref (ImageLayer *layer) {
+    g_atomic_int_inc (&((SharedLayer *) layer)->ref_count);
+    return layer;
+}
+
+static void shared_layer_unref (gpointer data) {
+    SharedLayer *shared = data;
+
+    if (g_atomic_int_dec_and_test (&shared->ref_count))
+        meme_layer_free (&shared->layer);
+}
+
+// Same generation means same state, except for sizes text measuring fills in later.
+static gboolean shared_layer_matches (const ImageLayer *frozen, const ImageLayer *layer) {
+    return frozen && frozen->id == layer->id && frozen->generation == layer->generation &&
+           frozen->width == layer->width && frozen->height == layer->height;
+}
+
+/* Freezes the layers. A layer unchanged since `prev` (may be NULL) was
+ * built reuses prev's copy, so a scene only copies what was edited. The
+ * scene shares pixbufs and frozen copies but never changes them. */
+MemeScene *meme_scene_new (GdkPixbuf *background, guint64 bg_generation, const MemeLayerStore *layers,
+                           const MemeScene *prev, gboolean cinematic, gboolean deep_fry, gboolean bw,
+                           guint32 seed) {
+    MemeScene *scene = scene_alloc ();
+    GHashTable *by_id = NULL;
+
+    scene->background = background ? g_object_ref (background) : NULL;
+    scene->bg_generation = bg_generation;
+    scene->layers = g_ptr_array_new_full (meme_layer_store_len (layers), shared_layer_unref);
+    for (guint i = 0; i < meme_layer_store_len (layers); i++) {
+        const ImageLayer *layer = meme_layer_store_get (layers, i);
+        ImageLayer *frozen = NULL;
+
+        // usually at the same index, after a reorder look it up by id
+        if (prev && i < prev->layers->len)
+            frozen = g_ptr_array_index (prev->layers, i);
+        if (prev && !shared_layer_matches (frozen, layer)) {
+            if (!by_id) {
+                by_id = g_hash_table_new (NULL, NULL);
+                for (guint k = 0; k < prev->layers->len; k++) {
+                    ImageLayer *old = g_ptr_array_index (prev->layers, k);
+
+                    g_hash_table_insert (by_id, GUINT_TO_POINTER (old->id), old);
+                }
+            }
+            frozen = g_hash_table_lookup (by_id, GUINT_TO_POINTER (layer->id));
+        }
+        g_ptr_array_add (scene->layers, shared_layer_matches (frozen, layer) ? shared_layer_ref (frozen)
+                                                                           : shared_layer_new (layer));
+    }
+    if (by_id) g_hash_table_unref (by_id);
+    scene->cinematic = cinematic;
+    scene->deep_fry = deep_fry;
+    scene->bw = bw;
+    scene->seed = seed;
+    return scene;
+}
+
+static MemeScene *scene_derive (const MemeScene *src) {
+    MemeScene *scene = g_new (MemeScene, 1);
+
+    *scene = *src;
+    scene->ref_count = 1;
+    if (scene->background) g_object_ref (scene->background);
+    g_ptr_array_ref (scene->layers);
+    return scene;
+}
+
+// Crop rectangle in fractions of the background size.
+MemeScene *meme_scene_new_cropped (const MemeScene *src, double x, double y, double w, double h) {
+    MemeScene *scene = scene_derive (src);
+
+    scene->crop_active = TRUE;
+    scene->crop_x = x; scene->crop_y = y;
+    scene->crop_w = w; scene->crop_h = h;
+    return scene;
+}
+
+// Same layers and effects over another background, e.g. the next GIF frame.
+MemeScene *meme_scene_new_for_background (const MemeScene *src, GdkPixbuf *background, guint64 bg_generation) {
+    MemeScene *scene = scene_derive (src);
+
+    g_clear_object (&scene->background);
+    scene->background = background ? g_object_ref (background) : NULL;
+    scene->bg_generation = bg_generation;
+    return scene;
+}
+
+MemeScene *meme_scene_ref (MemeScene *scene) {
+    g_atomic_int_inc (&scene->ref_count);
+    return scene;
+}
+
+void meme_scene_unref (MemeScene *scene) {
+    if (!scene || !g_atomic_int_dec_and_test (&scene->ref_count)) return;
+    g_clear_object (&scene->background);
+    g_ptr_array_unref (scene->layers);
+    g_free (scene);
+}
+
+// The part of a rendered `composite` that gets exported, as a new reference.
+GdkPixbuf *meme_scene_crop_output (const MemeScene *scene, GdkPixbuf *composite) {
+    int iw, ih;
+
+    if (!scene || !scene->crop_active) return g_object_ref (composite);
+
+    iw = gdk_pixbuf_get_width (composite);
+    ih = gdk_pixbuf_get_height (composite);
+    return gdk_pixbuf_new_subpixbuf (composite, scene->crop_x * iw, scene->crop_y * ih,
+                                     scene->crop_w * iw, scene->crop_h * ih);
+}
@@ -0,0 +1,50 @@
+/* meme-scene.h
+ *
+ * Copyright 2025 Giovanni
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#pragma once
+#include "meme-layer-store.h"
+
+/* An immutable snapshot of everything that decides what the meme looks
+ * like. Scenes are reference counted and never change once built, so any
+ * thread may render one while the editor goes on editing its own layers.
+ * Derived raster data (converted backgrounds, rasterized text) is not part
+ * of the scene, it lives in a MemeRenderCache. */
+typedef struct {
+    guint64 generation;         // editor snapshot counter, see meme_window_build_scene()
+    GdkPixbuf *background;
+    guint64 bg_generation;
+    GPtrArray *layers;          // frozen ImageLayer copies, bottom to top, shared between scenes
+    gboolean cinematic, deep_fry, bw;
+    guint32 seed;
+    gboolean crop_active;
+    double crop_x, crop_y, crop_w, crop_h;
+
+    /*< private >*/
+    gint ref_count;
+} MemeScene;
+
+MemeScene *meme_scene_new (GdkPixbuf *background, guint64 bg_generation, const MemeLayerStore *layers,
+                           const MemeScene *prev, gboolean cinematic, gboolean deep_fry, gboolean bw,
+                           guint32 seed);
+MemeScene *meme_scene_new_cropped (const MemeScene *scene, double x, double y, double w, double h);
+MemeScene *meme_scene_new_for_background (const MemeScene *scene, GdkPixbuf *background, guint64 bg_generation);
+MemeScene *meme_scene_ref (MemeScene *scene);
+void meme_scene_unref (MemeScene *scene);
+
+GdkPixbuf *meme_scene_crop_output (const MemeScene *scene, GdkPixbuf *composite);
@@ -0,0 +1,276 @@
+/* meme-text.c
+ *
+ * Copyright 2025 Giovanni
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#include "meme-text.h"
+#include <math.h>
+#include <string.h>
+#include <pango/pangocairo.h>
+
+#define TEXT_CACHE_DEFAULT_LIMIT (32 * 1024 * 1024)
+
+// The ink box sits this far inside the raster on every side, on top of
+// half the outline stroke.
+#define TEXT_PADDING 5
+
+// Shapes and line counts share one LRU, told apart by their key prefix.
+typedef struct {
+    char *key;
+    gpointer value;
+    GDestroyNotify free_value;
+    gsize bytes;
+    GList link;         // in text_cache.lru, most recently used first
+} TextEntry;
+
+static struct {
+    GMutex lock;
+    GHashTable *entries;  // key -> TextEntry
+    GQueue lru;
+    gsize bytes, limit;
+} text_cache = { .limit = TEXT_CACHE_DEFAULT_LIMIT };
+
+static void text_entry_free (gpointer data) {
+    TextEntry *entry = data;
+
+    g_free (entry->key);
+    entry->free_value (entry->value);
+    g_free (entry);
+}
+
+// Drops least recently used entries until the cache fits. Locked.
+static void text_cache_trim (gsize limit) {
+    while (text_cache.bytes > limit && text_cache.lru.tail) {
+        TextEntry *entry = text_cache.lru.tail->data;
+
+        g_queue_unlink (&text_cache.lru, &entry->link);
+        text_cache.bytes -= entry->bytes;
+        g_hash_table_remove (text_cache.entries, entry->key);
+    }
+}
+
+void meme_text_cache_set_limit (gsize bytes) {
+    g_mutex_lock (&text_cache.lock);
+    text_cache.limit = bytes;
+    text_cache_trim (bytes);
+    g_mutex_unlock (&text_cache.lock);
+}
+
+// Returns `ref`'d value for `key`, or NULL.
+static gpointer text_cache_lookup (const char *key, gpointer (*ref) (gpointer)) {
+    TextEntry *entry;
+    gpointer value = NULL;
+
+    g_mutex_lock (&text_cache.lock);
+    if (!text_cache.entries)
+        text_cache.entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, text_entry_free);
+    entry = g_hash_table_lookup (text_cache.entries, key);
+    if (entry) {
+        g_queue_unlink (&text_cache.lru, &entry->link);
+        g_queue_push_head_link (&text_cache.lru, &entry->link);
+        value = ref (entry->value);
+    }
+    g_mutex_unlock (&text_cache.lock);
+    return value;
+}
+
+// Takes `key` and a reference to `value`. Values are built unlocked, so a
+// racing thread may have stored the same thing meanwhile; that one wins.
+static void text_cache_insert (char *key, gpointer value, GDestroyNotify free_value, gsize bytes) {
+    TextEntry *entry;
+
+    g_mutex_lock (&text_cache.lock);
+    if (g_hash_table_contains (text_cache.entries, key)) {
+        g_mutex_unlock (&text_cache.lock);
+        g_free (key);
+        free_value (value);
+        return;
+    }
+    entry = g_new0 (TextEntry, 1);
+    entry->key = key;
+    entry->value = value;
+    entry->free_value = free_value;
+    entry->bytes = bytes;
+    entry->link.data = entry;
+    g_hash_table_insert (text_cache.entries, key, entry);
+    g_queue_push_head_link (&text_cache.lru, &entry->link);
+    text_cache.bytes += bytes;
+    text_cache_trim (text_cache.limit);
+    g_mutex_unlock (&text_cache.lock);
+}
+
+// Text is laid out to the layer's share of the template width at the
+// layer scale. The shape only depends on the scale through that width, so
+// pinning it lets a resize reuse one shape and merely draw it bigger or
+// smaller.
+static int text_wrap_width (const ImageLayer *layer, int bg_width) {
+    double scale = layer->text_wrap_scale > 0.0 ? layer->text_wrap_scale : layer->scale;
+
+    return (int)((bg_width * layer->wrap_width) / scale * PANGO_SCALE);
+}
+
+static char *shape_key (const ImageLayer *layer, int wrap_width) {
+    return g_strdup_printf ("s|%d|%.17g|%s|%s", wrap_width, layer->font_size,
+                            layer->font_family ? layer->font_family : "", layer->text);
+}
+
+MemeTextShape *meme_text_shape_ref (MemeTextShape *shape) {
+    g_atomic_int_inc (&shape->ref_count);
+    return shape;
+}
+
+void meme_text_shape_unref (MemeTextShape *shape) {
+    if (!shape || !g_atomic_int_dec_and_test (&shape->ref_count)) return;
+    cairo_path_destroy (shape->path);
+    g_free (shape);
+}
+
+// The caller unrefs the layout and its context.
+static PangoLayout *text_layout_new (const ImageLayer *layer, int wrap_width, double font_size) {
+    PangoContext *context = pango_font_map_create_context (pango_cairo_font_map_get_default ());
+    PangoLayout *layout = pango_layout_new (context);
+    PangoFontDescription *desc;
+
+    pango_layout_set_text (layout, layer->text, -1);
+    pango_layout_set_width (layout, wrap_width);
+    pango_layout_set_wrap (layout, PANGO_WRAP_WORD_CHAR);
+    pango_layout_set_alignment (layout, PANGO_ALIGN_CENTER);
+
+    desc = pango_font_description_from_string (layer->font_family ? layer->font_family : "Sans Bold");
+    pango_font_description_set_absolute_size (desc, font_size * PANGO_SCALE);
+    pango_layout_set_font_description (layout, desc);
+    pango_font_description_free (desc);
+    return layout;
+}
+
+// Shapes the text once and keeps the glyph outlines.
+static MemeTextShape *shape_text (const ImageLayer *layer, int wrap_width) {
+    PangoLayout *layout = text_layout_new (layer, wrap_width, layer->font_size);
+    PangoContext *context = pango_layout_get_context (layout);
+    double line_width = layer->font_size * 0.08;
+    int padding = TEXT_PADDING + (int) ceil (line_width / 2.0);
+    PangoRectangle ink_rect;
+    MemeTextShape *shape;
+    cairo_surface_t *surf;
+    cairo_t *cr;
+
+    pango_layout_get_pixel_extents (layout, &ink_rect, NULL);
+
+    surf = cairo_image_surface_create (CAIRO_FORMAT_A8, 1, 1);
+    cr = cairo_create (surf);
+    cairo_move_to (cr, padding - ink_rect.x, padding - ink_rect.y);
+    pango_cairo_layout_path (cr, layout);
+
+    shape = g_new0 (MemeTextShape, 1);
+    shape->ref_count = 1;
+    shape->path = cairo_copy_path (cr);
+    shape->width = ink_rect.width + 2 * padding;
+    shape->height = ink_rect.height + 2 * padding;
+    shape->line_width = line_width;
+
+    cairo_destroy (cr);
+    cairo_surface_destroy (surf);
+    g_object_unref (layout);
+    g_object_unref (context);
+    return shape;
+}
+
+// Line count at a probed size, no outlines or pixels.
+typedef struct {
+    int lines;
+} TextMetrics;
+
+static gpointer text_metrics_copy (gpointer metrics) {
+    return g_memdup2 (metrics, sizeof (TextMetrics));
+}
+
+static int text_line_count (const ImageLayer *layer, int wrap_width, int font_size) {
+    char *key = g_strdup_printf ("m|%d|%d|%s|%s", wrap_width, font_size,
+                                 layer->font_family ? layer->font_family : "", layer->text);
+    TextMetrics *metrics = text_cache_lookup (key, text_metrics_copy);
+    PangoLayout *layout;
+    PangoContext *context;
+    int lines;
+
+    if (metrics) {
+        lines = metrics->lines;
+        g_free (metrics);
+        g_free (key);
+        return lines;
+    }
+
+    layout = text_layout_new (layer, wrap_width, font_size);
+    context = pango_layout_get_context (layout);
+    lines = pango_layout_get_line_count (layout);
+    g_object_unref (layout);
+    g_object_unref (context);
+
+    metrics = g_new (TextMetrics, 1);
+    metrics->lines = lines;
+    text_cache_insert (key, metrics, g_free, sizeof (*metrics) + strlen (key));
+    return lines;
+}
+
+/* The largest whole font size in [min_size, max_size] at which the text
+ * wraps into at most layer->fit_lines lines, found by bisection. Every
+ * probe is a cached line count, no size in between gets rasterized. */
+double meme_text_fit_font_size (const ImageLayer *layer, int bg_width, int min_size, int max_size) {
+    int wrap_width = text_wrap_width (layer, bg_width);
+    int lo = min_size, hi = max_size;
+
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+
+        if (text_line_count (layer, wrap_width, mid) <= MAX (layer->fit_lines, 1)) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+static MemeTextShape *text_shape_get (const ImageLayer *layer, int wrap_width) {
+    char *key = shape_key (layer, wrap_width);
+    MemeTextShape *shape = text_cache_lookup (key, (gpointer (*) (gpointer)) meme_text_shape_ref);
+
+    if (shape) {
+        g_free (key);
+        return shape;
+    }
+    shape = shape_text (layer, wrap_width);
+    text_cache_insert (key, meme_text_shape_ref (shape), (GDestroyNotify) meme_text_shape_unref,
+                       sizeof (*shape) + shape->path->num_data * sizeof (cairo_path_data_t));
+    return shape;
+}
+
+// A new reference to the outlines of text `layer`.
+MemeTextShape *meme_text_shape (const ImageLayer *layer, int bg_width) {
+    return text_shape_get (layer, text_wrap_width (layer, bg_width));
+}
+
+// Round joins keep the stroke within half its width of the glyphs, which
+// the shape padding covers; a miter could spike past it at sharp corners.
+void meme_text_shape_draw (cairo_t *cr, const MemeTextShape *shape, const ImageLayer *layer) {
+    cairo_save (cr);
+    cairo_new_path (cr);
+    cairo_append_path (cr, shape->path);
+    cairo_set_source_rgba (cr, layer->stroke_color.red, layer->stroke_color.green, layer->stroke_color.blue, 1.0);
+    cairo_set_line_width (cr, shape->line_width);
+    cairo_set_line_join (cr, CAIRO_LINE_JOIN_ROUND);
+    cairo_stroke_preserve (cr);
+    cairo_set_source_rgba (cr, layer->text_color.red, layer->text_color.green, layer->text_color.blue, 1.0);
+    cairo_fill (cr);
+    cairo_restore (cr);
+}
@@ -0,0 +1,50 @@
+/* meme-text.h
+ *
+ * Copyright 2025 Giovanni
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#pragma once
+#include "meme-core.h"
+
+/* Text layers are shaped at their font size, wrapped to a share of the
+ * template width (90% unless the layer says otherwise). Shapes come from
+ * one process-wide LRU cache keyed by everything that affects them, so
+ * layers with the same look, undo copies and export threads all share
+ * them. Thread safe. */
+
+// Glyph outlines in the coordinates of the equivalent raster, which is
+// large enough to hold the outline stroke.
+typedef struct {
+    cairo_path_t *path;
+    int width, height;
+    double line_width;      // of the outline stroke
+
+    /*< private >*/
+    gint ref_count;
+} MemeTextShape;
+
+MemeTextShape *meme_text_shape (const ImageLayer *layer, int bg_width);
+MemeTextShape *meme_text_shape_ref (MemeTextShape *shape);
+void meme_text_shape_unref (MemeTextShape *shape);
+// Strokes and fills `shape` in the colours of `layer`, in user space. The
+// preview and the composite both draw text through this.
+void meme_text_shape_draw (cairo_t *cr, const MemeTextShape *shape, const ImageLayer *layer);
+
+double meme_text_fit_font_size (const ImageLayer *layer, int bg_width, int min_size, int max_size);
+
+// Upper bound on the pixel memory the cache keeps, in bytes.
+void meme_text_cache_set_limit (gsize bytes);
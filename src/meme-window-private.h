@@ -3,11 +3,9 @@
 #include <adwaita.h>
 #include "meme-core.h"
 #include "meme-renderer.h"
-
-typedef struct {
-    GdkPixbuf *pixbuf;
-    guint      delay_ms;
-} GifFrame;
+#include "meme-history.h"
+#include "meme-gif-stream.h"
+#include "meme-preview-paintable.h"
 
 struct _MemeWindow {
     AdwApplicationWindow parent_instance;
@@ -26,6 +24,9 @@ struct _MemeWindow {
     GtkTextView     *layer_text_view;
     AdwActionRow *layer_font_size_row;
     GtkSpinButton *layer_font_size;
+    AdwSwitchRow *layer_auto_fit_row;
+    AdwSpinRow *layer_fit_lines_row;
+    AdwSpinRow *layer_wrap_width_row;
     GtkMenuButton *main_menu_button;    
     GtkButton *export_button, *copy_clipboard_button, *zoom_in, *zoom_out;
     GtkButton *load_image_button, *pill_btn_open_image, *clear_button, *add_image_button;
@@ -47,7 +48,20 @@ struct _MemeWindow {
     GtkButton *crop_square_button, *crop_43_button, *crop_169_button;
     GtkButton *save_project_button, *load_project_button;   
     GdkPixbuf *template_image, *final_meme;
-    GList *layers, *undo_stack, *redo_stack;
+    guint64 template_generation;
+    MemeRenderCache *render_cache;
+    MemeScene *scene;
+    guint64 scene_generation;
+    MemePreviewPaintable *preview;
+    MemeDragSession *drag_session;
+    guint render_tick_id;
+    guint text_settle_id;
+    const char *preview_cursor;
+    gint64 text_rewrapped_at;
+    GCancellable *render_cancellable;
+    gboolean final_meme_is_full;
+    MemeLayerStore *layers;
+    MemeHistory *history;
     ImageLayer *selected_layer; 
     DragType drag_type;
     GtkWidget *text_color_btn;
@@ -59,14 +73,22 @@ struct _MemeWindow {
     double drag_obj_start_x, drag_obj_start_y, drag_obj_start_scale, drag_obj_start_h;
     double zoom_level;
     double crop_x, crop_y, crop_w, crop_h;
-    GdkPixbuf *crop_session_template_snapshot;
+    GdkPixbuf *template_source;         // the template before template_ops, to replay crops from
+    GArray *template_ops;               // MemeTemplateOp applied since the template was loaded
+    guint crop_session_ops;             // undo steps pushed since crop mode was entered
+    const char *edit_source;            // what the open slider/typing transaction is for
+    guint edit_settle_id;
+    guint32 fx_seed;
 
     gboolean  template_is_gif;
     gchar    *template_gif_path;
-    GArray   *gif_frames;
-    guint     gif_frame_index;
+    MemeGifFrames *gif_frames;          // the template's frames, shared with export
+    MemeGifStream *gif_stream;
+    int       gif_delay_ms;       // of the frame on screen
     guint     gif_timeout_id;
     GtkBox *export_loading_screen;
+    GtkButton *export_cancel_button;
+    GCancellable *export_cancellable;
     GtkPopover *file_popover;
 
     GtkButton *footer_add_image_button, *footer_add_text_button;
@@ -97,16 +119,18 @@ struct _MemeWindow {
 
 void sync_ui_with_layer(MemeWindow *self);
 void render_meme(MemeWindow *self);
+void meme_window_flush_render(MemeWindow *self);
+MemeScene *meme_window_build_scene(MemeWindow *self);
 void on_clear_clicked(MemeWindow *self);
 void apply_zoom(MemeWindow *self);
-void update_template_image(MemeWindow *self, GdkPixbuf *new_pixbuf);
+void meme_window_set_template_image(MemeWindow *self, GdkPixbuf *pixbuf);
+void meme_window_apply_template_op(MemeWindow *self, const MemeTemplateOp *op);
+void meme_window_revert_template_op(MemeWindow *self, const MemeTemplateOp *op);
+void meme_window_clear_history(MemeWindow *self);
+void meme_window_commit_edit(MemeWindow *self);
 
-GArray  *meme_gif_decode_frames (const char *path);
-void     meme_gif_frames_free (GArray *frames);
 void     meme_window_start_gif_animation (MemeWindow *self);
 void     meme_window_stop_gif_animation (MemeWindow *self);
 void     meme_window_pause_gif_animation (MemeWindow *self);
 void     meme_window_resume_gif_animation (MemeWindow *self);
-void     meme_window_transform_gif_frames_rotate (MemeWindow *self, gboolean clockwise);
-void     meme_window_transform_gif_frames_flip (MemeWindow *self, gboolean horizontal);
-void     meme_window_transform_gif_frames_crop (MemeWindow *self, int x, int y, int w, int h);
+
@@ -24,9 +24,12 @@
 #include "meme-window-private.h"
 #include "meme-fileio.h"
 #include "meme-canvas.h"
+#include "meme-preview-paintable.h"
+#include "meme-text.h"
 #include "meme-application.h"
 #include <glib/gstdio.h>
 #include <stdio.h>
+#include <math.h>
 #include "config.h"
 
 G_DEFINE_FINAL_TYPE (MemeWindow, meme_window, ADW_TYPE_APPLICATION_WINDOW)
@@ -35,12 +38,18 @@ static void populate_template_gallery (MemeWindow *self);
 static void set_template_select_mode (MemeWindow *self, gboolean active);
 static void update_template_gallery_empty_state (MemeWindow *self);
 static guint count_flowbox_children (GtkFlowBox *flowbox);
+static void on_layer_text_changed (MemeWindow *self);
+static void on_layer_fit_changed (MemeWindow *self);
+static void on_layer_control_changed (MemeWindow *self);
 
-static void draw_crop_overlay (GtkDrawingArea *area, cairo_t *cr, int width, int height, gpointer user_data) {
+// Crop and selection chrome are drawn over the picture in widget pixels,
+// so neither ever touches the composite texture.
+static void draw_editor_overlay (GtkDrawingArea *area, cairo_t *cr, int width, int height, gpointer user_data) {
     MemeWindow *self = MEME_WINDOW (user_data);
+    ImageLayer *layer = self->selected_layer;
     double img_w, img_h, scale, off_x, off_y;
 
-    if (!self->template_image || !gtk_toggle_button_get_active (self->crop_mode_button))
+    if (!self->template_image)
         return;
 
     img_w = gdk_pixbuf_get_width (self->template_image);
@@ -51,64 +60,291 @@ static void draw_crop_overlay (GtkDrawingArea *area, cairo_t *cr, int width, int
     off_x = (width - img_w * scale) / 2.0;
     off_y = (height - img_h * scale) / 2.0;
 
-    meme_draw_crop_chrome (cr, width, height,
-        off_x + self->crop_x * img_w * scale,
-        off_y + self->crop_y * img_h * scale,
-        self->crop_w * img_w * scale,
-        self->crop_h * img_h * scale);
+    if (gtk_toggle_button_get_active (self->crop_mode_button)) {
+        meme_draw_crop_chrome (cr, width, height,
+            off_x + self->crop_x * img_w * scale,
+            off_y + self->crop_y * img_h * scale,
+            self->crop_w * img_w * scale,
+            self->crop_h * img_h * scale);
+    } else if (layer) {
+        meme_draw_selection_chrome (cr,
+            off_x + layer->x * img_w * scale,
+            off_y + layer->y * img_h * scale,
+            layer->width * layer->scale * scale,
+            layer->height * layer->scale * scale,
+            layer->rotation);
+    }
 }
 
-void render_meme (MemeWindow *self) {
-    gboolean is_dragging, is_crop_drag, crop_active, cinematic, deepfry, bw_button;
-    GdkTexture *tex;
+// Shows the CPU composite in place of the render nodes.
+static void present_final_meme (MemeWindow *self) {
+    meme_preview_paintable_set_composite(self->preview, self->final_meme);
+    gtk_widget_queue_draw(GTK_WIDGET(self->crop_overlay_area));
+}
+
+static void cancel_full_render (MemeWindow *self) {
+    if (!self->render_cancellable) return;
+    g_cancellable_cancel (self->render_cancellable);
+    g_clear_object (&self->render_cancellable);
+}
+
+static void render_job_thread (GTask *task, gpointer source, gpointer task_data, GCancellable *cancellable) {
+    MemeWindow *self = MEME_WINDOW (source);
+    GdkPixbuf *pixbuf = meme_render_scene (task_data, self->render_cache, FALSE, cancellable);
+
+    if (pixbuf)
+        g_task_return_pointer (task, pixbuf, g_object_unref);
+    else
+        g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Render superseded");
+}
+
+static void on_full_render_ready (GObject *source, GAsyncResult *result, gpointer user_data) {
+    MemeWindow *self = MEME_WINDOW (source);
+    GdkPixbuf *pixbuf = g_task_propagate_pointer (G_TASK (result), NULL);
+
+    // a newer edit cancelled this job and already started its own
+    if (!pixbuf) return;
+
+    g_clear_object (&self->render_cancellable);
+    g_clear_object (&self->final_meme);
+    self->final_meme = pixbuf;
+    self->final_meme_is_full = TRUE;
+    present_final_meme (self);
+}
+
+static void start_full_render (MemeWindow *self) {
+    GTask *task;
+
+    self->render_cancellable = g_cancellable_new ();
+    task = g_task_new (self, self->render_cancellable, on_full_render_ready, NULL);
+    g_task_set_task_data (task, meme_scene_ref (self->scene), (GDestroyNotify) meme_scene_unref);
+    g_task_run_in_thread (task, render_job_thread);
+    g_object_unref (task);
+}
+
+// Resolves the font size of auto-fit text layers that changed. Only the
+// chosen size is ever rasterized.
+static void fit_text_layers (MemeWindow *self, int bg_width, gboolean all) {
+    double min_size, max_size, size;
+
+    gtk_spin_button_get_range (self->layer_font_size, &min_size, &max_size);
+    for (guint i = 0; i < meme_layer_store_len (self->layers); i++) {
+        ImageLayer *layer = meme_layer_store_get (self->layers, i);
+
+        if (layer->type != LAYER_TYPE_TEXT || !layer->auto_fit || !layer->text) continue;
+        if (!all && !(layer->dirty & (MEME_LAYER_DIRTY_CONTENT | MEME_LAYER_DIRTY_GEOMETRY))) continue;
+        size = meme_text_fit_font_size (layer, bg_width, min_size, max_size);
+        if (size == layer->font_size) continue;
+        layer->font_size = size;
+        meme_layer_mark_dirty (layer, MEME_LAYER_DIRTY_CONTENT);
+
+        if (layer == self->selected_layer) {
+            g_signal_handlers_block_by_func (self->layer_font_size, on_layer_text_changed, self);
+            gtk_spin_button_set_value (self->layer_font_size, layer->font_size);
+            g_signal_handlers_unblock_by_func (self->layer_font_size, on_layer_text_changed, self);
+        }
+    }
+}
+
+// Whether the editor state still matches `scene`. Layer generations are
+// compared by position, which also catches added, removed and reordered
+// layers and undo swapping in older copies.
+static gboolean scene_is_current (MemeWindow *self, const MemeScene *scene) {
+    gboolean crop = gtk_toggle_button_get_active (self->crop_mode_button);
+    guint i;
+
+    if (!scene || scene->background != self->template_image ||
+        scene->bg_generation != self->template_generation ||
+        scene->cinematic != gtk_toggle_button_get_active (self->cinematic_button) ||
+        scene->deep_fry != gtk_toggle_button_get_active (self->deep_fry_button) ||
+        scene->bw != gtk_toggle_button_get_active (self->bw_button) ||
+        scene->seed != self->fx_seed || scene->crop_active != crop)
+        return FALSE;
+    if (crop && (scene->crop_x != self->crop_x || scene->crop_y != self->crop_y ||
+                 scene->crop_w != self->crop_w || scene->crop_h != self->crop_h))
+        return FALSE;
+
+    if (meme_layer_store_len (self->layers) != scene->layers->len)
+        return FALSE;
+    for (i = 0; i < scene->layers->len; i++) {
+        const ImageLayer *layer = meme_layer_store_get (self->layers, i);
+
+        if (layer->dirty ||
+            layer->generation != ((ImageLayer *)g_ptr_array_index (scene->layers, i))->generation)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+// Snapshots the editor state, or returns the last snapshot again if
+// nothing changed. Also refreshes the size of the text layers that changed,
+// which hit-testing and the selection box read from the live layers.
+MemeScene *meme_window_build_scene (MemeWindow *self) {
+    MemeScene *scene, *cropped;
+
+    if (scene_is_current (self, self->scene))
+        return meme_scene_ref (self->scene);
+
+    if (self->template_image) {
+        int bg_width = gdk_pixbuf_get_width (self->template_image);
+        gboolean all = !self->scene || self->scene->bg_generation != self->template_generation;
+
+        fit_text_layers (self, bg_width, all);
+        meme_render_update_text_extents (self->layers, bg_width, all);
+    }
+    for (guint i = 0; i < meme_layer_store_len (self->layers); i++)
+        meme_layer_store_get (self->layers, i)->dirty = 0;
+
+    scene = meme_scene_new (self->template_image, self->template_generation, self->layers, self->scene,
+                            gtk_toggle_button_get_active (self->cinematic_button),
+                            gtk_toggle_button_get_active (self->deep_fry_button),
+                            gtk_toggle_button_get_active (self->bw_button),
+                            self->fx_seed);
+    scene->generation = ++self->scene_generation;
+    if (!gtk_toggle_button_get_active (self->crop_mode_button))
+        return scene;
+
+    cropped = meme_scene_new_cropped (scene, self->crop_x, self->crop_y, self->crop_w, self->crop_h);
+    meme_scene_unref (scene);
+    return cropped;
+}
+
+/* The preview is a render node tree built from the scene, GTK composites
+ * it. Only deep fry (pixelate and grain) has no node equivalent: its fast
+ * composite is shown straight away and, unless a drag is running, the
+ * full-quality one follows from a worker thread. `blocking` renders the
+ * full-quality final_meme right here, for export. */
+static void render_meme_now (MemeWindow *self, gboolean blocking) {
+    gboolean is_dragging, is_crop_drag;
+    MemeScene *scene;
 
     if (!self->template_image) return;
     
     is_dragging = (self->drag_type != DRAG_TYPE_NONE);
     is_crop_drag = (self->drag_type == DRAG_TYPE_CROP_MOVE ||
                              self->drag_type == DRAG_TYPE_CROP_RESIZE);
-    crop_active = gtk_toggle_button_get_active(self->crop_mode_button);
-    cinematic = gtk_toggle_button_get_active(self->cinematic_button);
-    deepfry = gtk_toggle_button_get_active(self->deep_fry_button);
-    bw_button = gtk_toggle_button_get_active(self->bw_button);
-
-    if (!self->final_meme || !is_crop_drag) {
-        if (self->final_meme) g_object_unref(self->final_meme);
-        self->final_meme = meme_render_composite(self->template_image,
-                                        self->layers,
-                                        cinematic,
-                                        deepfry,
-                                        bw_button,
-                                        is_dragging);
+
+    // the crop chrome lives on the overlay, the meme itself is unchanged
+    if (self->scene && is_crop_drag) {
+        gtk_widget_queue_draw(GTK_WIDGET(self->crop_overlay_area));
+        return;
     }
-    gtk_widget_queue_draw(GTK_WIDGET(self->meme_preview));
 
-    if (crop_active || (is_dragging && !is_crop_drag)) {
-        tex = gdk_texture_new_for_pixbuf(self->final_meme);
-    } else {
-        tex = meme_render_editor_overlay(
-            self->final_meme, self->layers, self->selected_layer,
-            FALSE, 0, 0, 0, 0
-        );
+    scene = meme_window_build_scene (self);
+
+    // same generation: the preview, and a finished or running full render, still hold
+    if (scene == self->scene && !blocking &&
+        (!scene->deep_fry || self->final_meme_is_full || self->render_cancellable)) {
+        meme_scene_unref (scene);
+        gtk_widget_queue_draw(GTK_WIDGET(self->crop_overlay_area));
+        return;
     }
 
-    gtk_picture_set_paintable(self->meme_preview, GDK_PAINTABLE(tex));
-    g_object_unref(tex);
+    cancel_full_render (self);
+    g_clear_pointer (&self->scene, meme_scene_unref);
+    self->scene = scene;
+    meme_preview_paintable_set_scene (self->preview, scene);
 
-    gtk_widget_queue_draw(GTK_WIDGET(self->crop_overlay_area));
+    g_clear_object (&self->final_meme);
+    self->final_meme_is_full = FALSE;
+    if (blocking) {
+        self->final_meme = meme_render_scene(scene, self->render_cache, FALSE, NULL);
+        self->final_meme_is_full = TRUE;
+    }
+
+    if (!scene->deep_fry) {
+        gtk_widget_queue_draw(GTK_WIDGET(self->crop_overlay_area));
+        return;
+    }
+
+    if (!self->final_meme) {
+        if (self->drag_session && self->drag_type == DRAG_TYPE_IMAGE_MOVE &&
+            self->drag_session->layer == self->selected_layer)
+            self->final_meme = meme_drag_session_render(self->drag_session, scene->cinematic, scene->deep_fry,
+                                                        scene->bw, scene->seed);
+        else
+            self->final_meme = meme_render_scene(scene, self->render_cache, TRUE, NULL);
+    }
+    present_final_meme (self);
+
+    if (!is_dragging && !self->final_meme_is_full)
+        start_full_render (self);
+}
+
+static gboolean on_render_tick (GtkWidget *widget, GdkFrameClock *clock, gpointer user_data) {
+    MemeWindow *self = MEME_WINDOW (user_data);
+
+    self->render_tick_id = 0;
+    render_meme_now (self, FALSE);
+    return G_SOURCE_REMOVE;
+}
+
+// Handlers only mark the meme dirty, the composite runs once on the next
+// frame clock tick no matter how many events arrived in between.
+void render_meme (MemeWindow *self) {
+    if (self->render_tick_id) return;
+    self->render_tick_id = gtk_widget_add_tick_callback (GTK_WIDGET (self), on_render_tick, self, NULL);
+}
+
+// Brings final_meme up to date at full quality right now, for code that
+// reads it directly.
+void meme_window_flush_render (MemeWindow *self) {
+    if (self->render_tick_id) {
+        gtk_widget_remove_tick_callback (GTK_WIDGET (self), self->render_tick_id);
+        self->render_tick_id = 0;
+    } else if (self->final_meme_is_full || self->drag_type != DRAG_TYPE_NONE) {
+        return;
+    }
+    render_meme_now (self, TRUE);
+}
+
+// Pause after which a slider scrub or a typing burst is one undo step.
+#define EDIT_SETTLE_MS 700
+
+void meme_window_commit_edit (MemeWindow *self) {
+    g_clear_handle_id (&self->edit_settle_id, g_source_remove);
+    if (!self->edit_source) return;
+    self->edit_source = NULL;
+    meme_history_commit (self->history, self->layers);
+}
+
+static gboolean on_edit_settled (gpointer user_data) {
+    MemeWindow *self = MEME_WINDOW (user_data);
+
+    self->edit_settle_id = 0;
+    meme_window_commit_edit (self);
+    return G_SOURCE_REMOVE;
+}
+
+/* Sidebar controls change a layer once per tick with no end signal, so
+ * their changes go into one transaction that stays open until they pause
+ * or a different control is used. Call before changing the layer. */
+static void begin_edit (MemeWindow *self, const char *source) {
+    // a drag is under way: the change is part of its step
+    if (!self->edit_source && meme_history_in_transaction (self->history)) return;
+    if (g_strcmp0 (self->edit_source, source) != 0) {
+        meme_window_commit_edit (self);
+        meme_history_begin (self->history, self->layers);
+        self->edit_source = source;
+    }
+    g_clear_handle_id (&self->edit_settle_id, g_source_remove);
+    self->edit_settle_id = g_timeout_add (EDIT_SETTLE_MS, on_edit_settled, self);
 }
 
 static void on_color_changed (GObject *object, GParamSpec *pspec, MemeWindow *self) {
     if (self->selected_layer && self->selected_layer->type == LAYER_TYPE_TEXT) {
         const GdkRGBA *tc = gtk_color_dialog_button_get_rgba(GTK_COLOR_DIALOG_BUTTON(self->text_color_btn));
         const GdkRGBA *sc = gtk_color_dialog_button_get_rgba(GTK_COLOR_DIALOG_BUTTON(self->stroke_color_btn));
-        
+
+        if ((!tc || gdk_rgba_equal (tc, &self->selected_layer->text_color)) &&
+            (!sc || gdk_rgba_equal (sc, &self->selected_layer->stroke_color)))
+            return;
+        begin_edit (self, "color");
         if (tc) self->selected_layer->text_color = *tc;
         if (sc) self->selected_layer->stroke_color = *sc;
-        
+        meme_layer_mark_dirty (self->selected_layer, MEME_LAYER_DIRTY_CONTENT);
+
         render_meme(self);
-        g_clear_object(&self->selected_layer->pixbuf);
-        self->selected_layer->pixbuf = NULL;
     }
 }
 
@@ -119,16 +355,23 @@ static void on_layer_text_changed (MemeWindow *self) {
     if (self->selected_layer && self->selected_layer->type == LAYER_TYPE_TEXT) {
         GtkTextBuffer *buffer;
         GtkTextIter start, end;
+        char *text;
+        double font_size = gtk_spin_button_get_value (self->layer_font_size);
 
-        g_free (self->selected_layer->text);
         buffer = gtk_text_view_get_buffer (self->layer_text_view);
         gtk_text_buffer_get_bounds (buffer, &start, &end);
-        
-        self->selected_layer->text = gtk_text_buffer_get_text (buffer, &start, &end, FALSE);
-        self->selected_layer->font_size = gtk_spin_button_get_value (self->layer_font_size);
+        text = gtk_text_buffer_get_text (buffer, &start, &end, FALSE);
+        if (g_strcmp0 (text, self->selected_layer->text) == 0 && font_size == self->selected_layer->font_size) {
+            g_free (text);
+            return;
+        }
+
+        begin_edit (self, "text");
+        g_free (self->selected_layer->text);
+        self->selected_layer->text = text;
+        self->selected_layer->font_size = font_size;
+        meme_layer_mark_dirty (self->selected_layer, MEME_LAYER_DIRTY_CONTENT);
         render_meme (self);
-        g_clear_object(&self->selected_layer->pixbuf);
-        self->selected_layer->pixbuf = NULL;
     }
 }
 
@@ -136,60 +379,100 @@ static void on_add_text_clicked (MemeWindow *self) {
     ImageLayer *new_layer;
 
     push_undo (self);
-    new_layer = g_new0 (ImageLayer, 1);
-    new_layer->type = LAYER_TYPE_TEXT;
+    new_layer = meme_layer_new (LAYER_TYPE_TEXT);
     new_layer->text = g_strdup ("Text");
     new_layer->font_size = 60.0;
     new_layer->x = 0.5; new_layer->y = 0.5;
     new_layer->scale = 1.0; new_layer->opacity = 1.0;
     new_layer->blend_mode = BLEND_NORMAL;
-    self->layers = g_list_append (self->layers, new_layer);
+    meme_layer_store_append (self->layers, new_layer);
     self->selected_layer = new_layer;
     sync_ui_with_layer(self);
     render_meme (self);
 }   
 
-void update_template_image (MemeWindow *self, GdkPixbuf *new_pixbuf) {
-    if (!new_pixbuf) return;
-    push_undo (self);
-    if (self->template_image) g_object_unref (self->template_image);
-    self->template_image = new_pixbuf;
+// Takes ownership of `pixbuf` (may be NULL). Every template swap goes
+// through here so caches keyed on template_generation see the change.
+void meme_window_set_template_image (MemeWindow *self, GdkPixbuf *pixbuf) {
+    g_clear_object (&self->template_image);
+    self->template_image = pixbuf;
+    self->template_generation++;
+}
+
+// Transforms the template, and GIF frames as they are decoded; template_ops remembers it.
+void meme_window_apply_template_op (MemeWindow *self, const MemeTemplateOp *op) {
+    if (!self->template_image) return;
+    if (!self->template_source)
+        self->template_source = g_object_ref (self->template_image);
+    g_array_append_val (self->template_ops, *op);
+    meme_window_set_template_image (self, meme_template_op_apply (op, self->template_image));
+    if (self->gif_stream)
+        meme_gif_stream_set_ops (self->gif_stream, self->template_ops);
+}
+
+// Undoes `op`, the newest of template_ops.
+void meme_window_revert_template_op (MemeWindow *self, const MemeTemplateOp *op) {
+    MemeTemplateOp inverse;
+    GdkPixbuf *frame = NULL;
+
+    if (!self->template_image || !self->template_ops->len) return;
+    g_array_set_size (self->template_ops, self->template_ops->len - 1);
+    if (self->gif_stream)
+        meme_gif_stream_set_ops (self->gif_stream, self->template_ops);
+    if (meme_template_op_invert (op, &inverse)) {
+        meme_window_set_template_image (self, meme_template_op_apply (&inverse, self->template_image));
+        return;
+    }
+    // a crop threw pixels away, start over from the source; for a GIF
+    // that is the frame on screen now, not the one the first op was on
+    if (self->gif_stream)
+        frame = meme_gif_frames_get (self->gif_frames, meme_gif_stream_get_shown (self->gif_stream),
+                                     self->template_ops, NULL);
+    if (frame)
+        meme_window_set_template_image (self, frame);
+    else if (self->template_source)
+        meme_window_set_template_image (self, meme_template_ops_replay (g_object_ref (self->template_source),
+                                                                        self->template_ops));
+}
+
+void meme_window_clear_history (MemeWindow *self) {
+    g_clear_handle_id (&self->edit_settle_id, g_source_remove);
+    self->edit_source = NULL;
+    meme_history_clear (self->history);
+    g_array_set_size (self->template_ops, 0);
+    g_clear_object (&self->template_source);
+    self->crop_session_ops = 0;
+}
+
+static void transform_template (MemeWindow *self, MemeTemplateOpType type) {
+    MemeTemplateOp op = { type };
+
+    meme_window_commit_edit (self);
+    meme_history_push_template (self->history, self->layers, &op);
+    meme_window_apply_template_op (self, &op);
+    // don't let a stale crop selection carry over onto the new image
+    if (gtk_toggle_button_get_active (self->crop_mode_button)) {
+        self->crop_session_ops++;
+        self->crop_x = 0.0; self->crop_y = 0.0;
+        self->crop_w = 1.0; self->crop_h = 1.0;
+    }
     render_meme (self);
 }
 
 static void on_rotate_clicked (GtkWidget *btn, MemeWindow *self) {
     gboolean clockwise;
-    GdkPixbuf *new_pix;
     if (!self->template_image) return;
     clockwise = (btn == GTK_WIDGET (self->rotate_right_button)) ||
                 (btn == GTK_WIDGET (self->footer_rotate_right_button));
-    new_pix = gdk_pixbuf_rotate_simple (self->template_image,
-    clockwise ? GDK_PIXBUF_ROTATE_CLOCKWISE : GDK_PIXBUF_ROTATE_COUNTERCLOCKWISE);
-    update_template_image (self, new_pix);
-    meme_window_transform_gif_frames_rotate (self, clockwise);
-    if (gtk_toggle_button_get_active (self->crop_mode_button)) {
-        self->crop_x = 0.0; self->crop_y = 0.0;
-        self->crop_w = 1.0; self->crop_h = 1.0;
-        render_meme (self);
-    }
+    transform_template (self, clockwise ? MEME_TEMPLATE_OP_ROTATE_CW : MEME_TEMPLATE_OP_ROTATE_CCW);
 }
 
 static void on_flip_clicked (GtkWidget *btn, MemeWindow *self) {
     gboolean horizontal;
-    GdkPixbuf *new_pix;
     if (!self->template_image) return;
     horizontal = (btn == GTK_WIDGET (self->flip_h_button)) ||
                  (btn == GTK_WIDGET (self->footer_flip_h_button));
-    new_pix = gdk_pixbuf_flip (self->template_image, horizontal);
-    update_template_image (self, new_pix);
-    meme_window_transform_gif_frames_flip (self, horizontal);
-    // Same reasoning as rotate: don't let a stale crop selection carry
-    // over onto the flipped image.
-    if (gtk_toggle_button_get_active (self->crop_mode_button)) {
-        self->crop_x = 0.0; self->crop_y = 0.0;
-        self->crop_w = 1.0; self->crop_h = 1.0;
-        render_meme (self);
-    }
+    transform_template (self, horizontal ? MEME_TEMPLATE_OP_FLIP_H : MEME_TEMPLATE_OP_FLIP_V);
 }
 
 static void on_crop_preset_clicked (GtkWidget *btn, MemeWindow *self) {
@@ -231,6 +514,7 @@ static void update_footer_pages (MemeWindow *self) {
 }
 
 static void on_exit_text_editing_clicked (MemeWindow *self) {
+    meme_window_commit_edit (self);
     self->selected_layer = NULL;
     sync_ui_with_layer (self);
     render_meme (self);
@@ -252,11 +536,10 @@ static void on_crop_mode_toggled (GtkToggleButton *btn, MemeWindow *self) {
     meme_window_pause_gif_animation (self);
     self->crop_x = 0.0; self->crop_y = 0.0;
     self->crop_w = 1.0; self->crop_h = 1.0;
-    g_clear_object (&self->crop_session_template_snapshot);
-    if (self->template_image)
-        self->crop_session_template_snapshot = g_object_ref (self->template_image);
+    self->crop_session_ops = 0;
     } else {
         gtk_widget_set_cursor (GTK_WIDGET (self->meme_preview), NULL);
+        self->preview_cursor = NULL;
         meme_window_resume_gif_animation (self);
     }
     update_footer_pages (self);
@@ -264,13 +547,12 @@ static void on_crop_mode_toggled (GtkToggleButton *btn, MemeWindow *self) {
 }
 
 static void on_cancel_crop_clicked (MemeWindow *self) {
-    // Restore the image exactly as it was when crop mode was entered,
-    // undoing any rotate/flip done mid-session. The undo_stack only
-    // tracks layers, not template_image, so we can't use it here.
-    if (self->crop_session_template_snapshot) {
-        if (self->template_image) g_object_unref (self->template_image);
-        self->template_image = self->crop_session_template_snapshot;
-        self->crop_session_template_snapshot = NULL;
+    // Restore the image exactly as it was when crop mode was entered by
+    // undoing any rotate/flip done mid-session; they don't get redone.
+    if (self->crop_session_ops) {
+        while (self->crop_session_ops && meme_history_can_undo (self->history))
+            myapp_window_perform_undo (self);
+        meme_history_drop_redo (self->history);
     }
     self->crop_x = 0.0; self->crop_y = 0.0;
     self->crop_w = 1.0; self->crop_h = 1.0;
@@ -279,10 +561,8 @@ static void on_cancel_crop_clicked (MemeWindow *self) {
 }
 
 static void on_apply_crop_clicked (MemeWindow *self) {
-    GdkPixbuf *sub;
-    GdkPixbuf *new_pix;
+    MemeTemplateOp op = { MEME_TEMPLATE_OP_CROP };
     int iw, ih, x, y, w, h;
-    GList *l;
 
     if (!self->template_image) return;
     iw = gdk_pixbuf_get_width(self->template_image);
@@ -293,33 +573,40 @@ static void on_apply_crop_clicked (MemeWindow *self) {
     h = self->crop_h * ih;
     if (w <= 0 || h <= 0) return;
 
-    push_undo(self);
+    op.x = x; op.y = y; op.width = w; op.height = h;
+    meme_window_commit_edit (self);
+    meme_history_push_template (self->history, self->layers, &op);
 
-    for (l = self->layers; l != NULL; l = l->next) {
-        ImageLayer *layer = (ImageLayer *)l->data;
+    for (guint i = 0; i < meme_layer_store_len(self->layers); i++) {
+        ImageLayer *layer = meme_layer_store_get(self->layers, i);
         double abs_x = layer->x * iw;
         double abs_y = layer->y * ih;
         layer->x = (abs_x - x) / (double)w;
         layer->y = (abs_y - y) / (double)h;
+        meme_layer_mark_dirty (layer, MEME_LAYER_DIRTY_GEOMETRY);
     }
-    sub = gdk_pixbuf_new_subpixbuf(self->template_image, x, y, w, h);
-    new_pix = gdk_pixbuf_copy(sub);
-    g_object_unref(sub);
-    update_template_image(self, new_pix); 
-    meme_window_transform_gif_frames_crop (self, x, y, w, h);
+    meme_window_apply_template_op (self, &op);
     self->crop_x = 0; self->crop_y = 0; self->crop_w = 1; self->crop_h = 1;
+    self->crop_session_ops = 0;
     gtk_toggle_button_set_active(self->crop_mode_button, FALSE);
-    g_clear_object (&self->crop_session_template_snapshot);
+    render_meme (self);
 }
 
 static void on_font_changed (GObject *object, GParamSpec *pspec, MemeWindow *self) {
     if (self->selected_layer && self->selected_layer->type == LAYER_TYPE_TEXT) {
         PangoFontDescription *desc = gtk_font_dialog_button_get_font_desc (self->font_choose_btn);
         if (desc) {
+            char *family = pango_font_description_to_string (desc);
+
+            if (g_strcmp0 (family, self->selected_layer->font_family) == 0) {
+                g_free (family);
+                return;
+            }
+            begin_edit (self, "font");
             g_free (self->selected_layer->font_family);
-            self->selected_layer->font_family = pango_font_description_to_string (desc);
+            self->selected_layer->font_family = family;
+            meme_layer_mark_dirty (self->selected_layer, MEME_LAYER_DIRTY_CONTENT);
             render_meme (self);
-            self->selected_layer->pixbuf = NULL;
         }
     }
 }
@@ -330,10 +617,10 @@ void sync_ui_with_layer(MemeWindow *self) {
     gboolean sensitive = (self->selected_layer != NULL);
     gboolean is_text = (sensitive && self->selected_layer->type == LAYER_TYPE_TEXT);
     gboolean is_crop = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(self->crop_mode_button));    
-    g_signal_handlers_block_by_func(self->layer_opacity_scale, on_text_changed, self);
 
-    g_signal_handlers_block_by_func(self->layer_opacity_scale, on_text_changed, self);
-    g_signal_handlers_block_by_func(self->layer_rotation_scale, on_text_changed, self);
+    g_signal_handlers_block_by_func(self->layer_opacity_scale, on_layer_control_changed, self);
+    g_signal_handlers_block_by_func(self->layer_rotation_scale, on_layer_control_changed, self);
+    g_signal_handlers_block_by_func(self->blend_mode_row, on_layer_control_changed, self);
     buffer = gtk_text_view_get_buffer (self->layer_text_view);
     g_signal_handlers_block_by_func(buffer, on_layer_text_changed, self);
     g_signal_handlers_block_by_func(self->layer_font_size, on_layer_text_changed, self);
@@ -345,18 +632,30 @@ void sync_ui_with_layer(MemeWindow *self) {
         if (is_text) {
             gtk_text_buffer_set_text(buffer, self->selected_layer->text ? self->selected_layer->text : "", -1);
             gtk_spin_button_set_value(self->layer_font_size, self->selected_layer->font_size);
+            g_signal_handlers_block_by_func(self->layer_auto_fit_row, on_layer_fit_changed, self);
+            g_signal_handlers_block_by_func(self->layer_fit_lines_row, on_layer_fit_changed, self);
+            g_signal_handlers_block_by_func(self->layer_wrap_width_row, on_layer_fit_changed, self);
+            adw_switch_row_set_active(self->layer_auto_fit_row, self->selected_layer->auto_fit);
+            adw_spin_row_set_value(self->layer_fit_lines_row, self->selected_layer->fit_lines);
+            adw_spin_row_set_value(self->layer_wrap_width_row, round(self->selected_layer->wrap_width * 100.0));
+            g_signal_handlers_unblock_by_func(self->layer_auto_fit_row, on_layer_fit_changed, self);
+            g_signal_handlers_unblock_by_func(self->layer_fit_lines_row, on_layer_fit_changed, self);
+            g_signal_handlers_unblock_by_func(self->layer_wrap_width_row, on_layer_fit_changed, self);
         }
     }
     gtk_widget_set_visible(GTK_WIDGET(self->layer_group), sensitive && !is_crop);
     gtk_widget_set_visible(GTK_WIDGET(self->layer_text_container), is_text);
     gtk_widget_set_visible(GTK_WIDGET(self->layer_font_size_row), is_text);
+    gtk_widget_set_visible(GTK_WIDGET(self->layer_fit_lines_row), is_text && self->selected_layer->auto_fit);
+    gtk_widget_set_sensitive(GTK_WIDGET(self->layer_font_size), !is_text || !self->selected_layer->auto_fit);
     gtk_widget_set_sensitive(GTK_WIDGET(self->layer_opacity_scale), sensitive);
     gtk_widget_set_sensitive(GTK_WIDGET(self->layer_rotation_scale), sensitive);
     gtk_widget_set_sensitive(GTK_WIDGET(self->blend_mode_row), sensitive);
     gtk_widget_set_sensitive(GTK_WIDGET(self->delete_layer_button), sensitive);
     
-    g_signal_handlers_unblock_by_func(self->layer_opacity_scale, on_text_changed, self);
-    g_signal_handlers_unblock_by_func(self->layer_rotation_scale, on_text_changed, self);
+    g_signal_handlers_unblock_by_func(self->layer_opacity_scale, on_layer_control_changed, self);
+    g_signal_handlers_unblock_by_func(self->layer_rotation_scale, on_layer_control_changed, self);
+    g_signal_handlers_unblock_by_func(self->blend_mode_row, on_layer_control_changed, self);
     g_signal_handlers_unblock_by_func(buffer, on_layer_text_changed, self);
     g_signal_handlers_unblock_by_func(self->layer_font_size, on_layer_text_changed, self);
 
@@ -387,9 +686,37 @@ void sync_ui_with_layer(MemeWindow *self) {
 
 static void on_layer_control_changed (MemeWindow *self) {
     if (self->selected_layer) {
-        self->selected_layer->opacity = gtk_range_get_value(GTK_RANGE(self->layer_opacity_scale));
-        self->selected_layer->rotation = gtk_range_get_value(GTK_RANGE(self->layer_rotation_scale));
-        self->selected_layer->blend_mode = (BlendMode)adw_combo_row_get_selected(self->blend_mode_row);
+        double opacity = gtk_range_get_value(GTK_RANGE(self->layer_opacity_scale));
+        double rotation = gtk_range_get_value(GTK_RANGE(self->layer_rotation_scale));
+        BlendMode blend_mode = (BlendMode)adw_combo_row_get_selected(self->blend_mode_row);
+
+        if (opacity == self->selected_layer->opacity && rotation == self->selected_layer->rotation &&
+            blend_mode == self->selected_layer->blend_mode)
+            return;
+        begin_edit (self, "controls");
+        self->selected_layer->opacity = opacity;
+        self->selected_layer->rotation = rotation;
+        self->selected_layer->blend_mode = blend_mode;
+        meme_layer_mark_dirty(self->selected_layer, MEME_LAYER_DIRTY_GEOMETRY | MEME_LAYER_DIRTY_APPEARANCE);
+        render_meme(self);
+    }
+}
+
+static void on_layer_fit_changed (MemeWindow *self) {
+    if (self->selected_layer && self->selected_layer->type == LAYER_TYPE_TEXT) {
+        gboolean auto_fit = adw_switch_row_get_active(self->layer_auto_fit_row);
+        int fit_lines = (int)adw_spin_row_get_value(self->layer_fit_lines_row);
+        double wrap_width = adw_spin_row_get_value(self->layer_wrap_width_row) / 100.0;
+
+        if (auto_fit == self->selected_layer->auto_fit && fit_lines == self->selected_layer->fit_lines &&
+            fabs(wrap_width - self->selected_layer->wrap_width) < 0.005)
+            return;
+        begin_edit (self, "fit");
+        self->selected_layer->auto_fit = auto_fit;
+        self->selected_layer->fit_lines = fit_lines;
+        self->selected_layer->wrap_width = wrap_width;
+        meme_layer_mark_dirty(self->selected_layer, MEME_LAYER_DIRTY_CONTENT);
+        sync_ui_with_layer(self);
         render_meme(self);
     }
 }
@@ -397,28 +724,46 @@ static void on_layer_control_changed (MemeWindow *self) {
 static void on_delete_layer_clicked (MemeWindow *self) {
     if (self->selected_layer) {
         push_undo (self);
-        self->layers = g_list_remove(self->layers, self->selected_layer);
-        meme_layer_free(self->selected_layer);
+        meme_window_end_drag_session (self);
+        meme_layer_store_remove(self->layers, self->selected_layer);
         self->selected_layer = NULL;
         sync_ui_with_layer(self);
         render_meme(self);
     }
 }
 
+// Raises (delta > 0) or lowers the selected layer in the stacking order.
+void meme_window_move_selected_layer (MemeWindow *self, int delta) {
+    int from = meme_layer_store_index_of (self->layers, self->selected_layer);
+    int to;
+
+    if (from < 0) return;
+    to = CLAMP (from + delta, 0, (int) meme_layer_store_len (self->layers) - 1);
+    if (to == from) return;
+
+    push_undo (self);
+    meme_window_end_drag_session (self);
+    meme_layer_store_move (self->layers, from, to);
+    render_meme (self);
+}
+
 void on_clear_clicked (MemeWindow *self) {
     meme_window_stop_gif_animation (self);
+    meme_window_end_drag_session (self);
+    cancel_full_render (self);
+    g_clear_pointer (&self->scene, meme_scene_unref);
     gtk_stack_set_visible_child_name (self->content_stack, "empty");
-    g_clear_object (&self->template_image);
+    meme_window_set_template_image (self, NULL);
     g_clear_object (&self->final_meme);
-    g_clear_object (&self->crop_session_template_snapshot);
-    if (self->layers) { meme_layer_list_free (self->layers); self->layers = NULL; }
-    free_history_stack (&self->undo_stack); free_history_stack (&self->redo_stack);
+    meme_layer_store_clear (self->layers);
+    meme_window_clear_history (self);
     self->selected_layer = NULL;
     sync_ui_with_layer(self);
-    gtk_picture_set_paintable (self->meme_preview, NULL);
+    meme_preview_paintable_set_scene (self->preview, NULL);
     gtk_toggle_button_set_active (self->deep_fry_button, FALSE);
     gtk_toggle_button_set_active (self->cinematic_button, FALSE);
     gtk_toggle_button_set_active (self->crop_mode_button, FALSE);
+    self->fx_seed = g_random_int();
     gtk_widget_set_sensitive(GTK_WIDGET(self->export_button), FALSE);
     gtk_widget_set_sensitive(GTK_WIDGET(self->global_filters_button), FALSE);
     gtk_widget_set_sensitive(GTK_WIDGET(self->add_text_button), FALSE);
@@ -441,18 +786,11 @@ void on_copy_clipboard_clicked (MemeWindow *self) {
     GdkPixbuf *save;
     GdkTexture *texture;
 
+    meme_window_flush_render (self);
     if (!self->final_meme) return;
 
     clipboard = gtk_widget_get_clipboard (GTK_WIDGET (self));
-    save = self->final_meme;
-
-    if (gtk_toggle_button_get_active(self->crop_mode_button)) {
-        int iw = gdk_pixbuf_get_width(save); 
-        int ih = gdk_pixbuf_get_height(save);
-        save = gdk_pixbuf_new_subpixbuf(save, self->crop_x * iw, self->crop_y * ih, self->crop_w * iw, self->crop_h * ih);
-    } else {
-        g_object_ref(save);
-    }
+    save = meme_scene_crop_output (self->scene, self->final_meme);
 
     texture = gdk_texture_new_for_pixbuf (save);
     gdk_clipboard_set_texture (clipboard, texture);
@@ -467,13 +805,20 @@ static void myapp_window_finalize (GObject *object) {
     meme_window_stop_gif_animation (self);
     g_clear_object (&self->template_image);
     g_clear_object (&self->final_meme);
-    g_clear_object (&self->crop_session_template_snapshot);
+    g_clear_object (&self->template_source);
+    g_clear_pointer (&self->template_ops, g_array_unref);
+    meme_window_end_drag_session (self);
+    cancel_full_render (self);
+    g_clear_object (&self->export_cancellable);
+    g_clear_pointer (&self->scene, meme_scene_unref);
+    g_clear_pointer (&self->render_cache, meme_render_cache_free);
+    g_clear_object (&self->preview);
     g_clear_object (&self->template_window);
     g_clear_object (&self->template_settings);
     g_free (self->template_gif_path);
-    if (self->layers) meme_layer_list_free (self->layers);
-    free_history_stack (&self->undo_stack);
-    free_history_stack (&self->redo_stack);
+    g_clear_pointer (&self->layers, meme_layer_store_free);
+    g_clear_handle_id (&self->edit_settle_id, g_source_remove);
+    g_clear_pointer (&self->history, meme_history_free);
     G_OBJECT_CLASS (meme_window_parent_class)->finalize (object);
 }
 
@@ -663,9 +1008,9 @@ static void on_template_selected (GtkFlowBox *flowbox, GtkFlowBoxChild *child, M
     template_path = g_object_get_data (G_OBJECT (image), "template-path");
     if (!template_path) return;
 
-    g_clear_object (&self->template_image);
-    if (self->layers) { meme_layer_list_free (self->layers); self->layers = NULL; }
-    free_history_stack (&self->undo_stack); free_history_stack (&self->redo_stack);
+    meme_window_set_template_image (self, NULL);
+    meme_layer_store_clear (self->layers);
+    meme_window_clear_history (self);
 
     g_clear_pointer (&self->template_gif_path, g_free);
     self->template_is_gif = !g_str_has_prefix (template_path, "resource://") &&
@@ -674,9 +1019,9 @@ static void on_template_selected (GtkFlowBox *flowbox, GtkFlowBoxChild *child, M
         self->template_gif_path = g_strdup (template_path);
 
     if (g_str_has_prefix (template_path, "resource://")) {
-        self->template_image = gdk_pixbuf_new_from_resource (template_path + 11, &error);
+        meme_window_set_template_image (self, gdk_pixbuf_new_from_resource (template_path + 11, &error));
     } else {
-        self->template_image = gdk_pixbuf_new_from_file (template_path, &error);
+        meme_window_set_template_image (self, gdk_pixbuf_new_from_file (template_path, &error));
     }
 
     if (self->template_image) {
@@ -959,6 +1304,7 @@ static void meme_window_class_init (MemeWindowClass *klass) {
     g_type_ensure (MEME_TYPE_THEME_SWITCHER);
     gtk_widget_class_set_template_from_resource (widget_class, "/io/github/vani_tty1/memerist/meme-window.ui");
     gtk_widget_class_bind_template_child(widget_class, MemeWindow, export_loading_screen);
+    gtk_widget_class_bind_template_child(widget_class, MemeWindow, export_cancel_button);
     gtk_widget_class_bind_template_child (widget_class, MemeWindow, layer_group);
     gtk_widget_class_bind_template_child (widget_class, MemeWindow, open_template_row);
     gtk_widget_class_bind_template_child (widget_class, MemeWindow, transform_group);
@@ -973,6 +1319,9 @@ static void meme_window_class_init (MemeWindowClass *klass) {
     gtk_widget_class_bind_template_child (widget_class, MemeWindow, layer_text_view);
     gtk_widget_class_bind_template_child (widget_class, MemeWindow, layer_font_size);
     gtk_widget_class_bind_template_child (widget_class, MemeWindow, layer_font_size_row);
+    gtk_widget_class_bind_template_child (widget_class, MemeWindow, layer_auto_fit_row);
+    gtk_widget_class_bind_template_child (widget_class, MemeWindow, layer_fit_lines_row);
+    gtk_widget_class_bind_template_child (widget_class, MemeWindow, layer_wrap_width_row);
     gtk_widget_class_bind_template_child (widget_class, MemeWindow, export_button);
     gtk_widget_class_bind_template_child (widget_class, MemeWindow, load_image_button);
     gtk_widget_class_bind_template_child(widget_class, MemeWindow, pill_btn_open_image);
@@ -1046,6 +1395,14 @@ static void meme_window_class_init (MemeWindowClass *klass) {
                                           "win.toggle-sidebar", NULL);
 }
 
+static void on_text_cache_size_changed (GSettings *settings, const char *key, gpointer user_data) {
+    meme_text_cache_set_limit ((gsize) g_settings_get_uint (settings, key) * 1024 * 1024);
+}
+
+static void on_undo_memory_limit_changed (GSettings *settings, const char *key, MemeWindow *self) {
+    meme_history_set_limit (self->history, (gsize) g_settings_get_uint (settings, key) * 1024 * 1024);
+}
+
 static void meme_window_init (MemeWindow *self) {
     GtkEventController *scroll;
     GtkEventController *key_controller;
@@ -1057,7 +1414,12 @@ static void meme_window_init (MemeWindow *self) {
         if (g_strcmp0 (PROFILE, "development") == 0)
             gtk_widget_add_css_class (GTK_WIDGET (self), "devel");
     #endif
-    self->layers = NULL; self->undo_stack = NULL; self->redo_stack = NULL;
+    self->layers = meme_layer_store_new (); self->history = meme_history_new ();
+    self->template_ops = g_array_new (FALSE, FALSE, sizeof (MemeTemplateOp));
+    self->fx_seed = g_random_int();
+    self->render_cache = meme_render_cache_new ();
+    self->preview = meme_preview_paintable_new ();
+    gtk_picture_set_paintable (self->meme_preview, GDK_PAINTABLE (self->preview));
     g_signal_connect (self->text_color_btn, "notify::rgba", G_CALLBACK (on_color_changed), self);
     g_signal_connect (self->stroke_color_btn, "notify::rgba", G_CALLBACK (on_color_changed), self);
     
@@ -1075,12 +1437,16 @@ static void meme_window_init (MemeWindow *self) {
     buffer = gtk_text_view_get_buffer (self->layer_text_view);
     g_signal_connect_swapped (buffer, "changed", G_CALLBACK (on_layer_text_changed), self);
     g_signal_connect_swapped (self->layer_font_size, "value-changed", G_CALLBACK (on_layer_text_changed), self);
+    g_signal_connect_swapped (self->layer_auto_fit_row, "notify::active", G_CALLBACK (on_layer_fit_changed), self);
+    g_signal_connect_swapped (self->layer_fit_lines_row, "notify::value", G_CALLBACK (on_layer_fit_changed), self);
+    g_signal_connect_swapped (self->layer_wrap_width_row, "notify::value", G_CALLBACK (on_layer_fit_changed), self);
     
     g_signal_connect_swapped (self->load_image_button, "clicked", G_CALLBACK (on_load_image_clicked), self);
     g_signal_connect_swapped (self->pill_btn_open_image, "clicked", G_CALLBACK(on_load_image_clicked), self);
     g_signal_connect_swapped (self->clear_button, "clicked", G_CALLBACK (on_clear_clicked), self);
     g_signal_connect_swapped (self->add_image_button, "clicked", G_CALLBACK (on_add_image_clicked), self);
     g_signal_connect_swapped (self->export_button, "clicked", G_CALLBACK (on_export_clicked), self);
+    g_signal_connect_swapped (self->export_cancel_button, "clicked", G_CALLBACK (on_export_cancel_clicked), self);
     g_signal_connect_swapped (self->save_project_button, "clicked", G_CALLBACK (myapp_window_save_project), self);
     g_signal_connect_swapped (self->load_project_button, "clicked", G_CALLBACK (on_load_project_clicked), self);
     g_signal_connect_swapped(self->copy_clipboard_button, "clicked", G_CALLBACK(on_copy_clipboard_clicked), self);
@@ -1101,6 +1467,10 @@ static void meme_window_init (MemeWindow *self) {
 
     self->template_settings = g_settings_new ("io.github.vani_tty1.memerist");
     update_restore_templates_sensitivity (self);
+    g_signal_connect (self->template_settings, "changed::text-cache-size", G_CALLBACK (on_text_cache_size_changed), NULL);
+    on_text_cache_size_changed (self->template_settings, "text-cache-size", NULL);
+    g_signal_connect (self->template_settings, "changed::undo-memory-limit", G_CALLBACK (on_undo_memory_limit_changed), self);
+    on_undo_memory_limit_changed (self->template_settings, "undo-memory-limit", self);
 
     g_signal_connect_swapped (self->import_template_button, "clicked", G_CALLBACK (on_import_template_clicked), self);
     g_signal_connect_swapped (self->delete_template_button, "clicked", G_CALLBACK (on_delete_template_clicked), self);
@@ -1118,7 +1488,7 @@ static void meme_window_init (MemeWindow *self) {
     g_signal_connect_swapped (self->blend_mode_row, "notify::selected", G_CALLBACK (on_layer_control_changed), self);
     g_signal_connect_swapped (self->delete_layer_button, "clicked", G_CALLBACK (on_delete_layer_clicked), self);
     
-    gtk_drawing_area_set_draw_func (self->crop_overlay_area, draw_crop_overlay, self, NULL);
+    gtk_drawing_area_set_draw_func (self->crop_overlay_area, draw_editor_overlay, self, NULL);
     gtk_widget_set_can_target (GTK_WIDGET (self->crop_overlay_area), FALSE);
 
     // Handlers moved to meme-canvas.c
@@ -1127,6 +1497,7 @@ static void meme_window_init (MemeWindow *self) {
     g_signal_connect (self->drag_gesture, "drag-begin", G_CALLBACK (on_drag_begin), self);
     g_signal_connect (self->drag_gesture, "drag-update", G_CALLBACK (on_drag_update), self);
     g_signal_connect (self->drag_gesture, "drag-end", G_CALLBACK (on_drag_end), self);
+    g_signal_connect (self->drag_gesture, "cancel", G_CALLBACK (on_drag_cancel), self);
     
     self->zoom_level = 1.0;
     g_signal_connect_swapped (self->zoom_in, "clicked", G_CALLBACK (on_zoom_in_clicked), self);
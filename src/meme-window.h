@@ -35,3 +35,4 @@ void myapp_window_perform_redo (MemeWindow *self);
 void myapp_window_save_project (MemeWindow *self);
 void on_copy_clipboard_clicked (MemeWindow *self);
 void meme_window_open_file (MemeWindow *self, GFile *file);
+void meme_window_move_selected_layer (MemeWindow *self, int delta);
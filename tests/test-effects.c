@@ -0,0 +1,162 @@
+/* test-effects.c
+ *
+ * Copyright 2025 Giovanni
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Checks the SSE2 and AVX2 kernels of meme-effects.c against the scalar
+ * reference, bit for bit. The kernels are static, so the file is built
+ * into the test. Widths cover every vector tail; pixels are random and
+ * the matrices push channels past both ends of the clamp. */
+#include "meme-effects.c"
+
+// Bytes after each row that no kernel may touch.
+#define GUARD 32
+#define GUARD_BYTE 0xa5
+#define ROUNDS 8
+
+static const int widths[] = { 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 33, 63, 67, 1021 };
+
+static gboolean isa_supported (MemeFxIsa isa) {
+    switch (isa) {
+#ifdef MEME_FX_X86
+        case MEME_FX_ISA_SSE2: __builtin_cpu_init (); return __builtin_cpu_supports ("sse2");
+        case MEME_FX_ISA_AVX2: __builtin_cpu_init (); return __builtin_cpu_supports ("avx2");
+#else
+        case MEME_FX_ISA_SSE2:
+        case MEME_FX_ISA_AVX2: return FALSE;
+#endif
+        case MEME_FX_ISA_SCALAR: return TRUE;
+        default: return FALSE;
+    }
+}
+
+static guchar *random_row (GRand *rng, int width) {
+    guchar *row = g_malloc ((gsize) width * 4 + GUARD);
+    int i;
+
+    for (i = 0; i < width * 4; i++) row[i] = (guchar) g_rand_int_range (rng, 0, 256);
+    memset (row + (gsize) width * 4, GUARD_BYTE, GUARD);
+    return row;
+}
+
+// The first rounds use the matrices the filters build, the rest are random.
+static void round_matrix (GRand *rng, int round, MemeFxMatrix *mx) {
+    MemeFxChain chain;
+    int i, j;
+
+    meme_fx_chain_init (&chain);
+    switch (round) {
+        case 0: break;
+        case 1: meme_fx_chain_grayscale (&chain); break;
+        case 2: meme_fx_chain_saturation (&chain, 3.0); break;
+        default:
+            for (i = 0; i < 3; i++) {
+                for (j = 0; j < 3; j++) chain.matrix.m[i][j] = (float) g_rand_double_range (rng, -1.5, 2.5);
+                chain.matrix.offset[i] = (float) g_rand_double_range (rng, -200.0, 200.0);
+            }
+            break;
+    }
+    *mx = chain.matrix;
+}
+
+static void test_color_matrix (gconstpointer data) {
+    MemeFxIsa isa = GPOINTER_TO_INT (data);
+    GRand *rng;
+    guint k;
+    int round;
+
+    if (!isa_supported (isa)) {
+        g_test_skip ("not supported by this CPU");
+        return;
+    }
+
+    rng = g_rand_new_with_seed (0x5eed);
+    for (k = 0; k < G_N_ELEMENTS (widths); k++) {
+        for (round = 0; round < ROUNDS; round++) {
+            gsize len = (gsize) widths[k] * 4 + GUARD;
+            guchar *expected = random_row (rng, widths[k]);
+            guchar *actual = g_memdup2 (expected, len);
+            MemeFxMatrix mx;
+
+            round_matrix (rng, round, &mx);
+            color_matrix_row_scalar (expected, widths[k], 4, &mx);
+            color_matrix_row (actual, widths[k], 4, isa, &mx);
+            g_assert_cmpmem (actual, len, expected, len);
+
+            g_free (expected);
+            g_free (actual);
+        }
+    }
+    g_rand_free (rng);
+}
+
+static void test_noise (gconstpointer data) {
+    MemeFxIsa isa = GPOINTER_TO_INT (data);
+    const int amplitudes[] = { 1, 12, 64, 127 };
+    GRand *rng;
+    guint k, a;
+
+    if (!isa_supported (isa)) {
+        g_test_skip ("not supported by this CPU");
+        return;
+    }
+
+    rng = g_rand_new_with_seed (0x5eed);
+    for (k = 0; k < G_N_ELEMENTS (widths); k++) {
+        for (a = 0; a < G_N_ELEMENTS (amplitudes); a++) {
+            int width = widths[k];
+            gsize len = (gsize) width * 4 + GUARD;
+            guchar *expected = random_row (rng, width);
+            guchar *actual = g_memdup2 (expected, len);
+            // preview rows map several columns onto one source pixel
+            int *src_x = source_coords (width, a % 2 ? 1.0 : 0.37);
+            gint8 *scratch = g_malloc ((gsize) width * 4);
+            guint32 seed = g_rand_int (rng);
+            int src_y = g_rand_int_range (rng, 0, 4096);
+
+            noise_row (expected, width, 4, MEME_FX_ISA_SCALAR, amplitudes[a], seed, src_y, src_x, scratch);
+            noise_row (actual, width, 4, isa, amplitudes[a], seed, src_y, src_x, scratch);
+            g_assert_cmpmem (actual, len, expected, len);
+
+            g_free (expected);
+            g_free (actual);
+            g_free (src_x);
+            g_free (scratch);
+        }
+    }
+    g_rand_free (rng);
+}
+
+int main (int argc, char *argv[]) {
+    const MemeFxIsa isas[] = { MEME_FX_ISA_SSE2, MEME_FX_ISA_AVX2 };
+    guint i;
+
+    g_test_init (&argc, &argv, NULL);
+
+    for (i = 0; i < G_N_ELEMENTS (isas); i++) {
+        char *path;
+
+        path = g_strdup_printf ("/effects/color-matrix/%s", meme_fx_isa_name (isas[i]));
+        g_test_add_data_func (path, GINT_TO_POINTER (isas[i]), test_color_matrix);
+        g_free (path);
+        path = g_strdup_printf ("/effects/noise/%s", meme_fx_isa_name (isas[i]));
+        g_test_add_data_func (path, GINT_TO_POINTER (isas[i]), test_noise);
+        g_free (path);
+    }
+    return g_test_run ();
+}